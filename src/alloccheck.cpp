@@ -0,0 +1,130 @@
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "SDL.h"
+#include "sfxd.h"
+
+// Checks the synth never allocates once it's running. It opens the sound
+// device through SFXD_Init, on SDL's dummy driver unless SDL_AUDIODRIVER says
+// otherwise, so SDL's audio thread mixes through the real callback. Then it
+// keeps every channel playing and counts each operator new made on any thread.
+// Exits with 1 if there were any, or if nothing got mixed.
+//
+//   vec_alloccheck [seconds]
+
+const int CHANNELS = 9;
+
+std::atomic<bool> counting(false);
+std::atomic<unsigned int> allocations(0);
+
+void* operator new(size_t size)
+{
+    if (counting.load(std::memory_order_relaxed))
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+// Something different on each channel, so every waveform and the
+// filters, phaser, vibrato and arpeggio all get mixed
+SFXD_Params make_params(int channel)
+{
+    SFXD_Params p = SFXD_Params();
+    p.wave_type = channel % WAVE_LAST;
+    p.bandlimited = channel & 1;
+    p.p_base_freq = 0.2f + 0.05f * channel;
+    p.p_freq_ramp = channel % 3 == 0 ? -0.1f : 0.0f;
+    p.p_duty = 0.3f;
+    p.p_vib_strength = channel % 2 ? 0.2f : 0.0f;
+    p.p_vib_speed = 0.4f;
+    p.p_env_attack = 0.05f;
+    p.p_env_sustain = 0.3f;
+    p.p_env_decay = 0.4f;
+    p.p_env_punch = 0.2f;
+    p.filter_on = channel % 3 != 1;
+    p.p_lpf_resonance = 0.5f;
+    p.p_lpf_freq = 0.6f;
+    p.p_lpf_ramp = -0.05f;
+    p.p_hpf_freq = 0.1f;
+    p.p_pha_offset = channel % 4 == 0 ? 0.2f : 0.0f;
+    p.p_pha_ramp = 0.05f;
+    p.p_repeat_speed = channel % 5 == 0 ? 0.5f : 0.0f;
+    p.p_arp_speed = 0.6f;
+    p.p_arp_mod = channel % 2 ? 0.3f : 0.0f;
+    p.sound_vol = 0.3f;
+    return p;
+}
+
+int main(int argc, char* argv[])
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 2.0;
+
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", 0);
+    if (SDL_Init(SDL_INIT_AUDIO) < 0)
+    {
+        fprintf(stderr, "Couldn't start SDL audio: %s\n", SDL_GetError());
+        return 1;
+    }
+
+    SFXD_Init(CHANNELS);
+    if (SDL_GetAudioStatus() != SDL_AUDIO_PLAYING)
+    {
+        fprintf(stderr, "Couldn't open the sound device: %s\n", SDL_GetError());
+        SDL_Quit();
+        return 1;
+    }
+
+    for (int c = 0; c < CHANNELS; ++c)
+        SFXD_SetParams(c, make_params(c));
+
+    // Everything's set up by now, so from here on nothing should allocate
+    counting = true;
+    Uint32 start = SDL_GetTicks();
+    for (int n = 0; SDL_GetTicks() - start < seconds * 1000; ++n)
+    {
+        for (int c = 0; c < CHANNELS; ++c)
+        {
+            if ((n + c) % 4 == 0)
+                SFXD_MutateChannel(c);
+            SFXD_PlaySample(c);
+        }
+        SDL_Delay(20);
+    }
+    counting = false;
+
+    SDL_CloseAudio();
+    SDL_Quit();
+
+    int peak = SFXD_PeakVoices();
+    printf("%u allocations over %.1fs of mixing with the %s kernel, %d voices at peak\n",
+           allocations.load(), seconds, SFXD_KernelName(SFXD_GetKernel()), peak);
+    if (!peak)
+    {
+        fprintf(stderr, "The audio callback never mixed anything\n");
+        return 1;
+    }
+    if (allocations)
+    {
+        fprintf(stderr, "The synth allocated while mixing\n");
+        return 1;
+    }
+    return 0;
+}
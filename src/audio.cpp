@@ -1,14 +1,18 @@
 #include <cmath>
+#include <cstdio>
+#include <algorithm>
 #include "vec.h"
 #include "sfxd.h"
 
-void SFXD_PlaySample();
-
 using namespace std;
 
 // Twelfth root of two
 const float trot = 0.0594630943592952645;
 
+// How far ahead of the beat to queue notes, in ms. More than a frame, so
+// they're all queued before they're due.
+const u32 LOOKAHEAD = 50;
+
 namespace audio {
 
 
@@ -57,14 +61,15 @@ void make_mode(int index, Scale destination)
     }
 }
 
-void play_sample(Channel& channel)
+// Play now, or at the given ticks
+void play_sample(Channel& channel, u32 at = 0)
 {
-    SFXD_PlaySample(channel.id);
+    SFXD_PlaySample(channel.id, at ? SFXD_TicksToTime(at) : 0);
 }
 
-void update_params(Channel& channel)
+void update_params(Channel& channel, u32 at = 0)
 {
-    SFXD_SetParams(channel.id, channel.params);
+    SFXD_SetParams(channel.id, channel.params, at ? SFXD_TicksToTime(at) : 0);
 }
 
 // Data
@@ -94,15 +99,143 @@ int consumed = 0;
 // rolling channel ids
 int nextId = -1;
 
+// Offline rendering
+FILE* wav = NULL;
+u32 starttime = 0; // ticks at init_offline
+u32 rendered = 0; // samples
+
 // Forward
 void init_channels();
+void init_music(u32 ticks);
 void set_note(Channel& channel, int note, float tonic = baseNote);
+void on_created(const GameState& state, const Event& event);
+void on_destroyed(const GameState& state, const Event& event);
 
 
-void init(u32 ticks)
+void init(u32 ticks, bool debug)
 {
     SFXD_Init(9);
 
+    // Make sure the vector synth still sounds like the scalar one
+    if (debug)
+    {
+        int kernel = SFXD_GetKernel();
+        float diff = SFXD_CheckKernel(kernel);
+        bml::logger << "Synth kernel: " << SFXD_KernelName(kernel) << ", off by " << diff << std::endl;
+        if (diff > 1e-4)
+            bml::warn("Synth kernel disagrees with the scalar one");
+    }
+
+    init_music(ticks);
+    events::subscribe(1 << Event::T_ENT_CREATED, on_created);
+    events::subscribe(1 << Event::T_ENT_DESTROYED, on_destroyed);
+}
+
+void write_u32(FILE* file, u32 value)
+{
+    unsigned char bytes[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, value >> 24 };
+    fwrite(bytes, 4, 1, file);
+}
+
+void write_u16(FILE* file, u32 value)
+{
+    unsigned char bytes[2] = { value & 0xff, (value >> 8) & 0xff };
+    fwrite(bytes, 2, 1, file);
+}
+
+// 16 bit mono PCM. The sizes get filled in once we know them.
+void write_wav_header(FILE* file, u32 freq, u32 samples)
+{
+    fwrite("RIFF", 4, 1, file);
+    write_u32(file, 36 + samples * 2);
+    fwrite("WAVEfmt ", 8, 1, file);
+    write_u32(file, 16);
+    write_u16(file, 1); // PCM
+    write_u16(file, 1); // mono
+    write_u32(file, freq);
+    write_u32(file, freq * 2); // bytes per second
+    write_u16(file, 2); // bytes per frame
+    write_u16(file, 16);
+    fwrite("data", 4, 1, file);
+    write_u32(file, samples * 2);
+}
+
+bool init_offline(u32 ticks, const char* filename)
+{
+    wav = fopen(filename, "wb");
+    if (!wav)
+    {
+        fprintf(stderr, "Couldn't open %s to render audio to\n", filename);
+        return false;
+    }
+
+    starttime = ticks;
+    SFXD_InitOffline(9, ticks);
+    write_wav_header(wav, SFXD_GetFrequency(), 0);
+    init_music(ticks);
+    events::subscribe(1 << Event::T_ENT_CREATED, on_created);
+    events::subscribe(1 << Event::T_ENT_DESTROYED, on_destroyed);
+    return true;
+}
+
+// Mix audio up to the given ticks
+void render(u32 ticks)
+{
+    if (!wav) return;
+
+    const int CHUNK = 4096;
+    static short buffer[CHUNK];
+    static unsigned char bytes[CHUNK * 2];
+    u32 target = (uint64_t)(ticks - starttime) * SFXD_GetFrequency() / 1000;
+    while (rendered < target)
+    {
+        int n = min<u32>(target - rendered, CHUNK);
+        SFXD_Render(buffer, n);
+        for (int i = 0; i < n; ++i)
+        {
+            bytes[2 * i] = buffer[i] & 0xff;
+            bytes[2 * i + 1] = (buffer[i] >> 8) & 0xff;
+        }
+        fwrite(bytes, 2, n, wav);
+        rendered += n;
+    }
+}
+
+void print_timing(const char* name, double audio, double cpu)
+{
+    if (audio == 0) return;
+    printf("  %-10s %8.2fs of audio in %7.3fs, %7.1fx realtime\n", name, audio, cpu, audio / cpu);
+}
+
+// Close the file and say how fast each part of the synth ran
+void finish_offline()
+{
+    if (!wav) return;
+
+    fseek(wav, 0, SEEK_SET);
+    write_wav_header(wav, SFXD_GetFrequency(), rendered);
+    fclose(wav);
+    wav = NULL;
+
+    SFXD_Timing timing;
+    SFXD_GetTiming(timing);
+
+    const Channel* all[] = { &enemy, &xp, &bass, &bell, &clink, &moog, &xylo, &perc, &hat };
+    const char* names[] = { "enemy", "xp", "bass", "bell", "clink", "moog", "xylo", "perc", "hat" };
+    const char* waves[WAVE_LAST] = { "square", "sawtooth", "sine", "noise" };
+
+    printf("Mixed %.2fs of audio in %.3fs, %.1fx realtime\n",
+           timing.mix_audio, timing.mix_cpu, timing.mix_audio / timing.mix_cpu);
+    printf("By channel, summed over voices:\n");
+    for (int i = 0; i < (int)(sizeof(all) / sizeof(all[0])); ++i)
+        print_timing(names[i], timing.channel_audio[all[i]->id], timing.channel_cpu[all[i]->id]);
+    printf("By waveform:\n");
+    for (int w = 0; w < WAVE_LAST; ++w)
+        print_timing(waves[w], timing.wave_audio[w], timing.wave_cpu[w]);
+}
+
+void init_music(u32 ticks)
+{
     make_mode(0, ionian);
     make_mode(1, dorian);
     make_mode(2, phrygian);
@@ -135,6 +268,7 @@ void init_channels()
 
     enemy.id = ++nextId;
     enemy.params.wave_type = WAVE_SINE;
+    enemy.params.bandlimited = true;
     enemy.params.p_base_freq = 0.3f;
     enemy.params.p_env_attack = 0.1f;
     enemy.params.p_env_sustain = 0.2f;
@@ -145,6 +279,7 @@ void init_channels()
     xp.id = ++nextId;
     xp.octave = -1;
     xp.params.wave_type = WAVE_SAWTOOTH;
+    xp.params.bandlimited = true;
     xp.params.p_base_freq = 0.45f;
     xp.params.p_freq_ramp = 0.01f;
     xp.params.p_env_attack = 0.3f;
@@ -158,6 +293,7 @@ void init_channels()
     bass.octave = -6;
     set_note(bass, TONIC);
     bass.params.wave_type = WAVE_SQUARE;
+    bass.params.bandlimited = true;
     bass.params.p_freq_ramp = 0.02f;
     bass.params.p_env_attack = 0.1f;
     bass.params.p_env_sustain = 0.2f;
@@ -171,6 +307,7 @@ void init_channels()
     bell.pattern = 0x00001000;
     bell.octave = -2;
     bell.params.wave_type = WAVE_SINE;
+    bell.params.bandlimited = true;
     set_note(bell, DOMINANT);
     bell.params.p_freq_ramp = 0.02f;
     bell.params.p_env_attack = 0.0f;
@@ -184,6 +321,7 @@ void init_channels()
 
     clink.id = ++nextId;
     clink.params.wave_type = WAVE_SQUARE;
+    clink.params.bandlimited = true;
     clink.params.p_base_freq = 0; // melodic
     clink.params.p_freq_ramp = 0;
     clink.params.p_env_attack = 0.0f;
@@ -198,6 +336,7 @@ void init_channels()
 
     moog.id = ++nextId;
     moog.params.wave_type = WAVE_SQUARE;
+    moog.params.bandlimited = true;
     moog.octave = -5;
     moog.params.p_freq_ramp = 0;
     moog.params.p_env_attack = 0.0f;
@@ -211,6 +350,7 @@ void init_channels()
 
     xylo.id = ++nextId;
     xylo.params.wave_type = WAVE_SINE;
+    xylo.params.bandlimited = true;
     xylo.params.p_base_freq = 0; // melodic
     xylo.params.p_freq_ramp = 0;
     xylo.params.p_env_attack = 0.1f;
@@ -260,98 +400,106 @@ void mutate_samples()
     SFXD_MutateChannel(6);
 }
 
-void update(const GameState& state, u32 ticks)
+// The key drops as the player grows
+void update_tonic(const GameState& state)
 {
     if (state.player.size < 1.0)
     {
         baseNote = 0.3 - 0.2 * state.player.size;
     }
+}
 
-    for (int i = 0; i < state.next_event; ++i)
+// Shots
+void on_created(const GameState& state, const Event& event)
+{
+    update_tonic(state);
+    switch (event.entity)
     {
-        if (state.events[i].type == Event::T_ENT_CREATED)
-        {
-            switch (state.events[i].entity)
-            {
-            case E_ROCKET:
-            {
-                set_note(moog, OCTAVE - fired++ % 8);
-                update_params(moog);
-                play_sample(moog);
-            } // fallthrough
-            case E_BULLET:
-            {
-                set_note(clink, LEADING - ++fired % 7);
-                update_params(clink);
-                play_sample(clink);
-            }
-            break;
-            }
-        }
-        if (state.events[i].type == Event::T_ENT_DESTROYED)
-        {
-            switch (state.events[i].entity)
-            {
-            case E_ENEMY:
-            {
-                int m = state.player.killcount % 7;
-                int p = state.player.killcount / 7;
-
-                enemy.octave = p;
-                bass.octave = p - 5;
-                bell.octave = -p - 2;
-                set_note(enemy, m);
-                set_note(xp, MAX_ENEMIES - m);
-                set_note(bass, TONIC);
-                set_note(bell, DOMINANT);
-
-                update_params(enemy);
-                update_params(xp);
-                update_params(bell);
-                update_params(bass);
-
-                play_sample(enemy);
-            }
-            break;
-            case E_XPCHUNK:
-            {
-                play_sample(xp);
-            }
-            break;
-            case E_BULLET:
-            {
-                set_note(xylo, LEADING - ++consumed % 7);
-                update_params(xylo);
-                play_sample(xylo);
-            }
-            break;
-            }
-        }
+    case E_ROCKET:
+    {
+        set_note(moog, OCTAVE - fired++ % 8);
+        update_params(moog);
+        play_sample(moog);
+    } // fallthrough
+    case E_BULLET:
+    {
+        set_note(clink, LEADING - ++fired % 7);
+        update_params(clink);
+        play_sample(clink);
+    }
+    break;
+    }
+}
+
+// Kills, pickups, and bullets soaked up by the square
+void on_destroyed(const GameState& state, const Event& event)
+{
+    update_tonic(state);
+    switch (event.entity)
+    {
+    case E_ENEMY:
+    {
+        int m = state.player.killcount % 7;
+        int p = state.player.killcount / 7;
+
+        enemy.octave = p;
+        bass.octave = p - 5;
+        bell.octave = -p - 2;
+        set_note(enemy, m);
+        set_note(xp, game::params.maxenemies - m);
+        set_note(bass, TONIC);
+        set_note(bell, DOMINANT);
+
+        update_params(enemy);
+        update_params(xp);
+        update_params(bell);
+        update_params(bass);
+
+        play_sample(enemy);
+    }
+    break;
+    case E_XPCHUNK:
+    {
+        play_sample(xp);
+    }
+    break;
+    case E_BULLET:
+    {
+        set_note(xylo, LEADING - ++consumed % 7);
+        update_params(xylo);
+        play_sample(xylo);
     }
+    break;
+    }
+}
 
+void update(const GameState& state, u32 ticks)
+{
+    update_tonic(state);
 
+    // Queue the beat a little early, stamped with when it's due
     float bpm = beats_per_minute(state);
-    if (ticks > hat.nextnote)
+    if (ticks + LOOKAHEAD > hat.nextnote)
     {
+        play_sample(hat, hat.nextnote);
         hat.nextnote += 60000.0 / (bpm * 4);
-        play_sample(hat);
     }
-    if (ticks > perc.nextnote)
+    if (ticks + LOOKAHEAD > perc.nextnote)
     {
+        play_sample(perc, perc.nextnote);
         perc.nextnote += 60000.0 / (bpm);
-        play_sample(perc);
     }
-    if (ticks > bass.nextnote)
+    if (ticks + LOOKAHEAD > bass.nextnote)
     {
+        play_sample(bass, bass.nextnote);
         bass.nextnote += 60000.0 / (bpm / 4);
-        play_sample(bass);
     }
-    if (ticks > bell.nextnote)
+    if (ticks + LOOKAHEAD > bell.nextnote)
     {
-        bell.nextnote += 60000.0 / (bpm * 3);
         set_note(bell, DOMINANT + state.player.killcount % 3 - 1);
-        update_params(bell);
-        if (rand() % 7 < state.player.killcount) play_sample(bell);
+        update_params(bell, bell.nextnote);
+        if (rand() % 7 < state.player.killcount) play_sample(bell, bell.nextnote);
+        bell.nextnote += 60000.0 / (bpm * 3);
     }
 }
 
@@ -366,4 +514,16 @@ void set_note(Channel& channel, int note, float tonic)
     channel.params.p_base_freq = tonic * currentMode[note] * pow(2, octave);
 }
 
+void mute()
+{
+    SFXD_Pause(true);
+}
+
+void print_stats()
+{
+    bml::logger << "Voices: " << SFXD_PeakVoices() << " peak, "
+                << SFXD_StolenVoices() << " stolen, "
+                << SFXD_DroppedCommands() << " commands dropped" << std::endl;
+}
+
 }
@@ -0,0 +1,13 @@
+/* This file is (ab)used by the C preprocessor
+   to embed shaders in gfx.cpp at compile time. */
+#include "common.glsl"
+
+STRINGIFY(
+    uniform float hue;
+    uniform float value = 1.0;
+
+void main() {
+    vec3 rgb = hsv2rgb(vec3(hue, 0.7, value));
+    gl_FragColor = vec4(rgb, 1);
+}
+)
@@ -0,0 +1,16 @@
+/* This file is (ab)used by the C preprocessor
+   to embed shaders in gfx.cpp at compile time. */
+#include "common.glsl"
+
+STRINGIFY(
+    attribute vec2 inPos;
+    uniform vec2 offset;
+    uniform vec2 size;
+    varying vec4 glPos;
+
+void main() {
+    // Stretch the viewport quad into a box whose bottom left is offset
+    vec2 pos = offset + (inPos + 1) * 0.5 * size;
+    gl_Position = glPos = vec4(pos, 0, 1);
+}
+)
@@ -0,0 +1,451 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <thread>
+#include "vec.h"
+
+using namespace bml;
+
+// Microbenchmarks for the simulation, no SDL or GL involved.
+// Prints JSON laid out like Google Benchmark's --benchmark_format=json
+// so runs can be diffed (or fed to its compare.py) across commits.
+//
+//   vec_bench [--filter substring] [--min-time seconds] [--out file] [--set name=value]...
+//
+// The pool is sized for the biggest population unless --set maxentities says otherwise,
+// in which case populations that don't fit run, and are named, at what does.
+// Afterwards it plays a fixed seed twice, and checks the broadphase against the
+// reference collision loop on its frames. It exits with 2 if either disagrees.
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct _Args {
+    const char* filter;
+    double mintime;
+    const char* out;
+} Args;
+
+Args args = { NULL, 0.5, NULL };
+FILE* out = stdout;
+int results = 0;
+
+// Keeps results alive so the optimizer can't drop the work
+volatile float sink;
+
+const int POPULATIONS[] = { 100, 1000, 10000, 100000 };
+
+// The checks at the end run in a pool this big, since the reference
+// collision loop goes over every pair of slots
+const int CHECK_ENTITIES = 2000;
+const int CHECK_POPULATION = 1000;
+
+GameState* pristine;
+GameState* state;
+Previous previous;
+
+// The profiler needs SDL's timers, and we do our own timing anyway
+namespace profile {
+void begin(int) {}
+void end(int) {}
+}
+
+float randf(u32& rng)
+{
+    return (xorshift(rng) % 20000) / 10000.0 - 1;
+}
+
+// Scatter count ents over the playfield, in roughly the mix a busy game has
+void populate(GameState& gs, int count, u32 seed)
+{
+    const EType MIX[] = { E_BULLET, E_BULLET, E_BULLET, E_TURD, E_XPCHUNK, E_XPCHUNK, E_ENEMY, E_ROCKET };
+    const int MIXES = sizeof(MIX) / sizeof(MIX[0]);
+
+    game::init(gs, seed);
+    gs.player.life = 1000000; // don't die partway
+    gs.dticks = 20;
+
+    u32 rng = seed;
+    while (gs.entities.total < count && gs.entities.total < gs.entities.capacity)
+    {
+        Entity e;
+        memset(&e, 0, sizeof(e));
+        e.type = MIX[xorshift(rng) % MIXES];
+        e.life = 1.0;
+        e.pos.x = randf(rng) * 0.95;
+        e.pos.y = randf(rng) * 0.95;
+        e.vel.x = randf(rng);
+        e.vel.y = randf(rng);
+        e.hue = (xorshift(rng) % 360) / 360.0;
+        game::add_entity(gs, e);
+    }
+}
+
+// POPULATIONS as far as room allows, without the repeats clamping makes.
+// Benchmarks are named and counted by these, so they say what really ran.
+int populations(int room, int* out)
+{
+    int n = 0;
+    for (int i = 0; i < (int)(sizeof(POPULATIONS) / sizeof(POPULATIONS[0])); ++i)
+    {
+        int count = maximum(minimum(POPULATIONS[i], room), 0);
+        if (n == 0 || out[n - 1] != count)
+            out[n++] = count;
+    }
+    return n;
+}
+
+bool wanted(const char* name)
+{
+    return !args.filter || strstr(name, args.filter);
+}
+
+void report(const char* name, long iterations, double seconds, long items)
+{
+    double ns = seconds * 1e9 / iterations;
+    fprintf(out, "%s    {\n", results++ ? ",\n" : "");
+    fprintf(out, "      \"name\": \"%s\",\n", name);
+    fprintf(out, "      \"run_type\": \"iteration\",\n");
+    fprintf(out, "      \"iterations\": %ld,\n", iterations);
+    fprintf(out, "      \"real_time\": %f,\n", ns);
+    fprintf(out, "      \"cpu_time\": %f,\n", ns);
+    fprintf(out, "      \"time_unit\": \"ns\",\n");
+    fprintf(out, "      \"items_per_second\": %f\n", items * iterations / seconds);
+    fprintf(out, "    }");
+    fflush(out);
+}
+
+// Repeat setup + body until mintime of body has been measured. Only the
+// body is timed, since resetting a big pool can cost more than the work.
+template <typename Setup, typename Body>
+void run(const char* name, long items, Setup setup, Body body)
+{
+    if (!wanted(name)) return;
+
+    long iterations = 0;
+    double seconds = 0;
+    while (seconds < args.mintime || iterations == 0)
+    {
+        setup();
+        Clock::time_point start = Clock::now();
+        body();
+        seconds += std::chrono::duration<double>(Clock::now() - start).count();
+        ++iterations;
+    }
+    report(name, iterations, seconds, items);
+}
+
+void reset()
+{
+    game::copy(*state, *pristine);
+    events::clear();
+}
+
+void bench_collide(int count)
+{
+    char name[64];
+    sprintf(name, "BM_collide/%d", count);
+    if (!wanted(name)) return;
+
+    populate(*pristine, count, 1234);
+    previous.squarepos = pristine->square.pos;
+    run(name, count, reset, []() {
+        game::collide(*state, previous);
+    });
+}
+
+void bench_update(int count)
+{
+    char name[64];
+    sprintf(name, "BM_update/%d", count);
+    if (!wanted(name)) return;
+
+    // Fire and move, so the frame does the usual spawning as well
+    static Input input;
+    memset(&input, 0, sizeof(input));
+    input.axes.x1 = 0.3;
+    input.axes.y1 = 0.5;
+    input.axes.x2 = 0.8;
+    input.axes.y2 = 0.2;
+    input.shoot = true;
+    input.poop = true;
+
+    populate(*pristine, count, 1234);
+    static u32 ticks;
+    ticks = 0;
+    run(name, count, reset, []() {
+        ticks += 20;
+        game::update(*state, ticks, false, input);
+    });
+}
+
+void bench_spawn_enemies(int count)
+{
+    char name[64];
+    sprintf(name, "BM_spawn_enemies/%d", count);
+    if (!wanted(name)) return;
+
+    int maxenemies = game::params.maxenemies;
+    populate(*pristine, count, 1234);
+    pristine->player.killcount = maxenemies;
+    run(name, maxenemies, reset, []() {
+        game::spawn_enemies(*state);
+    });
+}
+
+void bench_segment_intersection(int count)
+{
+    char name[64];
+    sprintf(name, "BM_check_segment_intersection/%d", count);
+    if (!wanted(name)) return;
+
+    static Vec* segments;
+    static int n;
+    n = count;
+    segments = new Vec[4 * count];
+    u32 rng = 1234;
+    for (int i = 0; i < 4 * count; ++i)
+    {
+        segments[i].x = randf(rng);
+        segments[i].y = randf(rng);
+    }
+
+    run(name, count, []() {}, []() {
+        float total = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const Vec* s = &segments[4 * i];
+            total += game::check_segment_intersection(s[0], s[1], s[2], s[3]);
+        }
+        sink = total;
+    });
+    delete[] segments;
+}
+
+// Events the benchmark's subscribers have seen
+int hits = 0;
+int others = 0;
+
+void count_hit(const GameState&, const Event&)
+{
+    ++hits;
+}
+
+void count_other(const GameState&, const Event&)
+{
+    ++others;
+}
+
+// A frame's worth of events, handed to two subscribers that each want
+// some of the types. Doubles as a stress test of the stream growing.
+void bench_events(int count)
+{
+    char name[64];
+    sprintf(name, "BM_events/%d", count);
+    if (!wanted(name)) return;
+
+    static int n;
+    n = count;
+    run(name, count, []() { events::clear(); }, []() {
+        for (int i = 0; i < n; ++i)
+        {
+            Event evt = { (Event::Type)(i % Event::T_LAST), E_ENEMY, { 0, 0 }, 0, 0.1f };
+            events::emit(evt);
+        }
+        hits = others = 0;
+        events::dispatch(*state);
+    });
+
+    // Each should have been seen once, and nothing lost
+    EventStats stats = events::stats();
+    if (hits + others != count || stats.dropped)
+        fprintf(stderr, "%s: subscribers saw %d of %d events, %u dropped\n",
+                name, hits + others, count, stats.dropped);
+}
+
+// Made up input for a frame, roughly what a player does
+Input make_input(u32& rng, int frame)
+{
+    Input input;
+    memset(&input, 0, sizeof(input));
+    input.axes.x1 = randf(rng);
+    input.axes.y1 = randf(rng);
+    input.axes.x2 = randf(rng);
+    input.axes.y2 = randf(rng);
+    input.shoot = true;
+    input.poop = (frame % 10 == 0);
+    input.auxshoot = (frame % 50 == 0);
+    input.respawn = true;
+    return input;
+}
+
+void step(GameState& gs, const Input& input)
+{
+    gs.ticks += 20;
+    gs.dticks = 20;
+    events::clear();
+    game::update(gs, gs.ticks, false, input);
+}
+
+// Play frames of a busy game from seed, with made up input, hashing each one
+void play(GameState& gs, u32 seed, int frames, u32* hashes)
+{
+    populate(gs, CHECK_POPULATION, seed);
+    gs.ticks = 0;
+    u32 rng = seed;
+    for (int i = 0; i < frames; ++i)
+    {
+        step(gs, make_input(rng, i));
+        hashes[i] = game::hash(gs);
+    }
+}
+
+// The same seed and input should make the same game every time, or
+// replays can't be trusted
+bool check_determinism(u32 seed, int frames)
+{
+    u32* first = new u32[frames];
+    u32* second = new u32[frames];
+    play(*state, seed, frames, first);
+    play(*state, seed, frames, second);
+    int diverged = -1;
+    for (int i = 0; i < frames && diverged < 0; ++i)
+        if (first[i] != second[i])
+            diverged = i;
+    if (diverged >= 0)
+        fprintf(stderr, "Seed %u played differently the second time, from frame %d\n", seed, diverged);
+    delete[] first;
+    delete[] second;
+    return diverged < 0;
+}
+
+// Resolve each frame's ent-ent collisions on two copies of it, with the
+// broadphase and with the reference loop, and check they hash the same
+bool check_broadphase(u32 seed, int frames)
+{
+    GameState* grid = new GameState();
+    GameState* reference = new GameState();
+    populate(*state, CHECK_POPULATION, seed);
+    state->ticks = 0;
+    u32 rng = seed;
+    int diverged = -1;
+    for (int i = 0; i < frames && diverged < 0; ++i)
+    {
+        game::copy(*grid, *state);
+        game::copy(*reference, *state);
+        events::clear();
+        game::collide_entities(*grid);
+        game::collide_entities_reference(*reference);
+        if (game::hash(*grid) != game::hash(*reference))
+            diverged = i;
+        step(*state, make_input(rng, i));
+    }
+    if (diverged >= 0)
+        fprintf(stderr, "Broadphase disagrees with the reference loop on frame %d of seed %u\n", diverged, seed);
+    game::release(*grid);
+    game::release(*reference);
+    delete grid;
+    delete reference;
+    return diverged < 0;
+}
+
+bool parse_args(int argc, char** argv)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* arg = argv[i];
+        if (!strcmp(arg, "--filter") && i + 1 < argc)
+            args.filter = argv[++i];
+        if (!strcmp(arg, "--min-time") && i + 1 < argc)
+            args.mintime = atof(argv[++i]);
+        if (!strcmp(arg, "--out") && i + 1 < argc)
+            args.out = argv[++i];
+        if (!strcmp(arg, "--set") && i + 1 < argc)
+        {
+            char* name = argv[++i];
+            char* value = strchr(name, '=');
+            if (!value)
+            {
+                fprintf(stderr, "--set wants name=value, got %s\n", name);
+                return false;
+            }
+            *value++ = '\0';
+            if (!game::set_param(name, value))
+                return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    game::params.maxentities = 100000;
+    if (!parse_args(argc, argv))
+        return 1;
+    if (args.out)
+    {
+        out = fopen(args.out, "w");
+        if (!out)
+        {
+            fprintf(stderr, "Couldn't open %s\n", args.out);
+            return 1;
+        }
+    }
+
+    pristine = new GameState();
+    state = new GameState();
+
+    char date[64];
+    time_t now = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"context\": {\n");
+    fprintf(out, "    \"date\": \"%s\",\n", date);
+    fprintf(out, "    \"executable\": \"%s\",\n", argv[0]);
+    fprintf(out, "    \"num_cpus\": %u,\n", std::thread::hardware_concurrency());
+    fprintf(out, "    \"max_entities\": %d,\n", game::params.maxentities);
+#ifdef NDEBUG
+    fprintf(out, "    \"library_build_type\": \"release\"\n");
+#else
+    fprintf(out, "    \"library_build_type\": \"debug\"\n");
+#endif
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"benchmarks\": [\n");
+
+    const int POPS = sizeof(POPULATIONS) / sizeof(POPULATIONS[0]);
+    int fits[POPS];
+    int nfits = populations(game::params.maxentities, fits);
+    // Leave room for a full wave so nothing gets evicted
+    int roomy[POPS];
+    int nroomy = populations(game::params.maxentities - game::params.maxenemies, roomy);
+    for (int i = 0; i < nfits; ++i)
+        bench_collide(fits[i]);
+    for (int i = 0; i < nroomy; ++i)
+        bench_spawn_enemies(roomy[i]);
+    for (int i = 0; i < POPS; ++i)
+        bench_segment_intersection(POPULATIONS[i]);
+    for (int i = 0; i < nfits; ++i)
+        bench_update(fits[i]);
+
+    events::clear();
+    events::subscribe(1 << Event::T_ENT_HIT, count_hit);
+    events::subscribe(1 << Event::T_ENT_CREATED | 1 << Event::T_ENT_DESTROYED, count_other);
+    for (int i = 0; i < POPS; ++i)
+        bench_events(POPULATIONS[i]);
+
+    fprintf(out, "\n  ]\n}\n");
+
+    game::params.maxentities = CHECK_ENTITIES;
+    bool deterministic = check_determinism(1234, 3000);
+    bool agrees = check_broadphase(1234, 500);
+
+    game::release(*pristine);
+    game::release(*state);
+    delete pristine;
+    delete state;
+    if (out != stdout)
+        fclose(out);
+    return deterministic && agrees ? 0 : 2;
+}
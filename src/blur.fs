@@ -0,0 +1,24 @@
+/* This file is (ab)used by the C preprocessor
+   to embed shaders in gfx.cpp at compile time. */
+#include "common.glsl"
+
+STRINGIFY(
+varying vec4 glPos;
+uniform sampler2D texSource;
+uniform vec2 dir;
+uniform vec2 textureSize;
+
+/* 9-tap Gaussian along dir in 5 fetches. Each pair of neighbouring taps
+   is one linearly filtered fetch from between them, weighted by both. */
+void main() {
+  vec2 pos = (glPos.xy + vec2(1,1)) / 2.0;
+  vec2 pixel = dir / textureSize;
+  vec4 final = texture2D(texSource, pos) * 0.2270270270;
+  final += texture2D(texSource, pos + pixel * 1.3846153846) * 0.3162162162;
+  final += texture2D(texSource, pos - pixel * 1.3846153846) * 0.3162162162;
+  final += texture2D(texSource, pos + pixel * 3.2307692308) * 0.0702702703;
+  final += texture2D(texSource, pos - pixel * 3.2307692308) * 0.0702702703;
+  gl_FragColor = final;
+}
+)
+#undef STRINGIFY
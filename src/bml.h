@@ -44,80 +44,89 @@ const Vec UNIT_X = { 1, 0 };
 const Vec UNIT_Y = { 0, 1 };
 
 // http://stackoverflow.com/q/563198
-static float cross(const Vec& lhs, const Vec& rhs)
+static inline float cross(const Vec& lhs, const Vec& rhs)
 {
     return lhs.x * rhs.y - rhs.x * lhs.y;
 }
 
-static void negate(Vec& vec)
+static inline void negate(Vec& vec)
 {
     vec.x = -vec.x;
     vec.y = -vec.y;
 }
 
-static Vec operator -(const Vec& unary)
+static inline Vec operator -(const Vec& unary)
 {
     Vec ret = {-unary.x, -unary.y};
     return ret;
 }
-static Vec operator -(const Vec& lhs, const Vec& rhs)
+static inline Vec operator -(const Vec& lhs, const Vec& rhs)
 {
     Vec ret = {lhs.x - rhs.x, lhs.y - rhs.y};
     return ret;
 }
-static Vec operator +(const Vec& lhs, const Vec& rhs)
+static inline Vec operator +(const Vec& lhs, const Vec& rhs)
 {
     Vec ret = {lhs.x + rhs.x, lhs.y + rhs.y};
     return ret;
 }
-static void operator *=(Vec& lhs, float rhs)
+static inline void operator *=(Vec& lhs, float rhs)
 {
     lhs.x *= rhs;
     lhs.y *= rhs;
 }
-static void operator -=(Vec& lhs, const Vec& rhs)
+static inline void operator -=(Vec& lhs, const Vec& rhs)
 {
     lhs.x -= rhs.x;
     lhs.y -= rhs.y;
 }
-static void operator +=(Vec& lhs, const Vec& rhs)
+static inline void operator +=(Vec& lhs, const Vec& rhs)
 {
     lhs.x += rhs.x;
     lhs.y += rhs.y;
 }
-static Vec operator *(float rhs, const Vec& lhs)
+static inline Vec operator *(float rhs, const Vec& lhs)
 {
     Vec ret = {lhs.x * rhs, lhs.y * rhs};
     return ret;
 }
-static Vec operator *(const Vec& lhs, float rhs)
+static inline Vec operator *(const Vec& lhs, float rhs)
 {
     Vec ret = {lhs.x * rhs, lhs.y * rhs};
     return ret;
 }
 
-static std::ostream& operator<<(std::ostream& lhs, const Vec& rhs)
+static inline std::ostream& operator<<(std::ostream& lhs, const Vec& rhs)
 {
     return lhs << '[' << rhs.x << ',' << rhs.y << ']';
 }
 
-static void warn(const char* message)
+static inline void warn(const char* message)
 {
     logger << "WARNING: " << message << std::endl;
 }
 
+// xorshift32, for when the sequence has to be reproducible. Seed must be nonzero.
+static inline u32 xorshift(u32& state)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
 // random float between -1 and 1
-static float normrand()
+static inline float normrand(u32& state)
 {
-    return (float)(rand() % 32767) * 2.0 / (float)32767 - 1.0;
+    return (float)(xorshift(state) % 32767) * 2.0 / (float)32767 - 1.0;
 }
 
-static int maximum(int a, int b)
+static inline int maximum(int a, int b)
 {
     return a > b ? a : b;
 }
 
-static int minimum(int a, int b)
+static inline int minimum(int a, int b)
 {
     return a < b ? a : b;
 }
@@ -0,0 +1,16 @@
+/* This file is (ab)used by the C preprocessor
+   to embed shaders in gfx.cpp at compile time. */
+#include "common.glsl"
+
+STRINGIFY(
+varying vec4 glPos;
+uniform sampler2D texSource;
+uniform sampler2D texBloom;
+uniform float value;
+
+void main() {
+  vec2 pos = (glPos.xy + vec2(1,1)) / 2.0;
+  gl_FragColor = texture2D(texSource, pos) + texture2D(texBloom, pos) * value;
+}
+)
+#undef STRINGIFY
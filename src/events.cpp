@@ -0,0 +1,145 @@
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include "vec.h"
+
+using namespace std;
+using namespace bml;
+
+// This frame's events, in the order they happened. They live in blocks
+// that stay allocated from frame to frame, so once the stream has grown
+// to fit a busy frame, emitting is a copy and a bump.
+namespace events {
+
+const int BLOCK_EVENTS = 512;
+const int MAX_SUBSCRIBERS = 8;
+
+typedef struct _Subscription {
+    u32 types; // 1 << Event::T_* for each type it wants
+    Subscriber fn;
+} Subscription;
+
+struct _Stream {
+    Event** blocks;
+    int nblocks; // allocated
+    int maxblocks; // room in blocks
+    int capacity; // events that fit in the blocks
+    int count; // events this frame
+
+    Subscription subscribers[MAX_SUBSCRIBERS];
+    int nsubscribers;
+
+    EventStats stats;
+} stream;
+
+// Make room for one more block, false if we're out of memory
+bool grow()
+{
+    if (stream.nblocks == stream.maxblocks)
+    {
+        int maxblocks = stream.maxblocks ? stream.maxblocks * 2 : 8;
+        Event** blocks = (Event**)realloc(stream.blocks, maxblocks * sizeof(Event*));
+        if (!blocks) return false;
+        stream.blocks = blocks;
+        stream.maxblocks = maxblocks;
+    }
+
+    Event* block = new (nothrow) Event[BLOCK_EVENTS];
+    if (!block) return false;
+    stream.blocks[stream.nblocks++] = block;
+    stream.capacity += BLOCK_EVENTS;
+    ++stream.stats.grown;
+    return true;
+}
+
+void emit(const Event& event)
+{
+    if (stream.count == stream.capacity && !grow())
+    {
+        ++stream.stats.dropped;
+        return;
+    }
+
+    unsigned i = stream.count++;
+    stream.blocks[i / BLOCK_EVENTS][i % BLOCK_EVENTS] = event;
+}
+
+int count()
+{
+    return stream.count;
+}
+
+const Event& get(int i)
+{
+    return stream.blocks[(unsigned)i / BLOCK_EVENTS][(unsigned)i % BLOCK_EVENTS];
+}
+
+void truncate(int n)
+{
+    if (n < stream.count)
+        stream.count = n;
+}
+
+// Totals are kept up here rather than on every emit
+void clear()
+{
+    stream.stats.emitted += stream.count;
+    if (stream.count > stream.stats.peak)
+        stream.stats.peak = stream.count;
+    stream.count = 0;
+}
+
+bool subscribe(u32 types, Subscriber fn)
+{
+    if (stream.nsubscribers == MAX_SUBSCRIBERS)
+    {
+        warn("Too many event subscribers");
+        return false;
+    }
+    Subscription s = { types, fn };
+    stream.subscribers[stream.nsubscribers++] = s;
+    return true;
+}
+
+// Hand each event to whoever wants its type. Everyone sees the events
+// in the order they were emitted.
+void dispatch(const GameState& state)
+{
+    u32 wanted = 0;
+    for (int s = 0; s < stream.nsubscribers; ++s)
+        wanted |= stream.subscribers[s].types;
+    if (!wanted) return;
+
+    for (int b = 0; b * BLOCK_EVENTS < stream.count; ++b)
+    {
+        const Event* block = stream.blocks[b];
+        int n = min(stream.count - b * BLOCK_EVENTS, BLOCK_EVENTS);
+        for (int i = 0; i < n; ++i)
+        {
+            u32 bit = 1 << block[i].type;
+            if (!(wanted & bit)) continue;
+            for (int s = 0; s < stream.nsubscribers; ++s)
+                if (stream.subscribers[s].types & bit)
+                    stream.subscribers[s].fn(state, block[i]);
+        }
+    }
+}
+
+EventStats stats()
+{
+    EventStats ret = stream.stats;
+    ret.emitted += stream.count;
+    ret.peak = max(ret.peak, stream.count);
+    ret.capacity = stream.capacity;
+    return ret;
+}
+
+void print_stats()
+{
+    EventStats s = stats();
+    logger << "Events: " << s.emitted << " emitted, " << s.peak << " peak in a frame, "
+           << s.capacity << " capacity (grew " << s.grown << " times), "
+           << s.dropped << " dropped" << std::endl;
+}
+
+} // namespace events
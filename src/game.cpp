@@ -1,21 +1,65 @@
+#include <climits>
 #include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include "vec.h"
 
 /* using namespace std; */
+using std::sort;
 using namespace bml;
 
 namespace game {
 
-// TODO cleanup this initialization
-struct _GameParams {
-    float movespeed,  playersize, squarespeed, mousemovespeed, rotspeed, drag, bulletdrag, bulletspeed, enemyspeed, hitbox, squaregrowth, squaregravity, squaredecay;
-} params = {   0.005,        0.2,  0.01,       20.0,            6,  0.9,      0.97,          0.03, 0.01,       0.005, 1.01,        0.04, 0.995 };
+GameParams params = {
+    500, // maxentities
+    15, // maxenemies
+    0.005, // movespeed
+    0.2, // playersize
+    0.01, // squarespeed
+    20.0, // mousemovespeed
+    6, // rotspeed
+    0.9, // drag
+    0.97, // bulletdrag
+    0.03, // bulletspeed
+    0.01, // enemyspeed
+    0.005, // hitbox
+    1.01, // squaregrowth
+    0.04, // squaregravity
+    0.995, // squaredecay
+};
 
-void collide(GameState& state, const GameState& previousState);
-void add_entity(GameState& state, Entity& e);
-void attract_entity(GameState& state, Entity& e);
+// Names for setting params from a file or the command line
+struct _ParamName {
+    const char* name;
+    int* i; // one of these
+    float* f;
+} PARAM_NAMES[] = {
+    { "maxentities", &params.maxentities, NULL },
+    { "maxenemies", &params.maxenemies, NULL },
+    { "movespeed", NULL, &params.movespeed },
+    { "playersize", NULL, &params.playersize },
+    { "squarespeed", NULL, &params.squarespeed },
+    { "mousemovespeed", NULL, &params.mousemovespeed },
+    { "rotspeed", NULL, &params.rotspeed },
+    { "drag", NULL, &params.drag },
+    { "bulletdrag", NULL, &params.bulletdrag },
+    { "bulletspeed", NULL, &params.bulletspeed },
+    { "enemyspeed", NULL, &params.enemyspeed },
+    { "hitbox", NULL, &params.hitbox },
+    { "squaregrowth", NULL, &params.squaregrowth },
+    { "squaregravity", NULL, &params.squaregravity },
+    { "squaredecay", NULL, &params.squaredecay },
+};
+
+void collide(GameState& state, const Previous& previous);
+bool check_broadphase(const GameState& state);
+int add_entity(GameState& state, Entity& e);
+void attract_entities(GameState& state, EType type);
 bool spend_life(GameState& state, float cost);
-void destroy_entity(GameState& state, Entity& e);
+void destroy_entity(GameState& state, int id);
+void free_entity(GameState& state, int id);
 void spawn_enemies(GameState& state);
 
 float mag_squared(const Vec& vec)
@@ -40,17 +84,291 @@ float check_segment_intersection(Vec p, Vec q, Vec r, Vec s)
     return -1;
 }
 
+bool set_param(const char* name, const char* value)
+{
+    for (int i = 0; i < (int)(sizeof(PARAM_NAMES) / sizeof(*PARAM_NAMES)); ++i)
+    {
+        if (strcmp(name, PARAM_NAMES[i].name)) continue;
+        char* end;
+        long l = strtol(value, &end, 10);
+        float f = PARAM_NAMES[i].f ? strtof(value, &end) : 0;
+        bool bad = end == value || *end;
+        if (PARAM_NAMES[i].i)
+            bad = bad || l < 1 || l > INT_MAX;
+        else
+            bad = bad || !std::isfinite(f);
+        // The broadphase grid is sized by it
+        if (PARAM_NAMES[i].f == &params.hitbox)
+            bad = bad || f <= 0;
+        if (bad)
+        {
+            fprintf(stderr, "Bad value for %s: %s\n", name, value);
+            return false;
+        }
+        if (PARAM_NAMES[i].i)
+            *PARAM_NAMES[i].i = l;
+        else
+            *PARAM_NAMES[i].f = f;
+        return true;
+    }
+    fprintf(stderr, "No such param: %s\n", name);
+    return false;
+}
+
+// One "name value" per line. Blank lines and lines starting with # are skipped.
+bool load_params(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+    {
+        fprintf(stderr, "Couldn't open %s for params\n", filename);
+        return false;
+    }
+
+    bool ok = true;
+    char line[256];
+    while (fgets(line, sizeof(line), file))
+    {
+        char name[64], value[64];
+        int n = sscanf(line, " %63s %63s", name, value);
+        if (n <= 0 || name[0] == '#') continue;
+        if (n != 2 || !set_param(name, value))
+            ok = false;
+    }
+    fclose(file);
+    return ok;
+}
+
 int entity_count(const GameState& state)
 {
-    int ents = 0;
-    for (int i = 0; i < MAX_ENTITIES; ++i)
-        if (state.entities[i].life > 0)
-            ++ents;
-    return ents;
+    return state.entities.total;
+}
+
+// Bytes of storage behind each slot
+const size_t SLOT_BYTES = sizeof(EType) + 7 * sizeof(float) + E_LAST * sizeof(int)
+                        + 4 * sizeof(int) + sizeof(u32);
+
+template <typename T>
+T* carve(char*& storage, int count)
+{
+    T* ret = (T*)storage;
+    storage += count * sizeof(T);
+    return ret;
+}
+
+// Point the arrays into storage, which has room for capacity slots
+void lay_out_entities(Entities& ents, char* storage, int capacity)
+{
+    ents.capacity = capacity;
+    ents.storage = storage;
+    ents.type = carve<EType>(storage, capacity);
+    ents.life = carve<float>(storage, capacity);
+    ents.x = carve<float>(storage, capacity);
+    ents.y = carve<float>(storage, capacity);
+    ents.vx = carve<float>(storage, capacity);
+    ents.vy = carve<float>(storage, capacity);
+    ents.rotation = carve<float>(storage, capacity);
+    ents.hue = carve<float>(storage, capacity);
+    for (int t = 0; t < E_LAST; ++t)
+        ents.live[t] = carve<int>(storage, capacity);
+    ents.index = carve<int>(storage, capacity);
+    ents.free = carve<int>(storage, capacity);
+    ents.born = carve<u32>(storage, capacity);
+    ents.older = carve<int>(storage, capacity);
+    ents.newer = carve<int>(storage, capacity);
+}
+
+// Empty the pool, keeping its storage
+void clear_entities(Entities& ents)
+{
+    Entities cleared;
+    memset(&cleared, 0, sizeof(cleared));
+    lay_out_entities(cleared, ents.storage, ents.capacity);
+    memset(ents.storage, 0, ents.capacity * SLOT_BYTES);
+    ents = cleared;
+
+    for (int i = 0; i < ents.capacity; ++i)
+        ents.index[i] = -1;
+    for (int t = 0; t < E_LAST; ++t)
+        ents.oldest[t] = ents.newest[t] = -1;
+
+    // Hand out low slots first
+    for (int i = ents.capacity - 1; i >= 0; --i)
+        ents.free[ents.nfree++] = i;
+    ents.overflow = OVERFLOW_EVICT;
+}
+
+// Make sure the pool has exactly capacity slots. Whatever was in it is lost
+// if it has to be reallocated.
+void reserve_entities(Entities& ents, int capacity)
+{
+    if (ents.storage && ents.capacity == capacity) return;
+    delete[] ents.storage;
+    lay_out_entities(ents, new char[capacity * SLOT_BYTES], capacity);
+}
+
+void release(GameState& state)
+{
+    delete[] state.entities.storage;
+    memset(&state.entities, 0, sizeof(state.entities));
+}
+
+void copy(GameState& to, const GameState& from)
+{
+    Entities ents = to.entities;
+    reserve_entities(ents, from.entities.capacity);
+    to = from;
+    lay_out_entities(to.entities, ents.storage, ents.capacity);
+    memcpy(ents.storage, from.entities.storage, ents.capacity * SLOT_BYTES);
+}
+
+float lerp(float a, float b, float t)
+{
+    return a + (b - a) * t;
+}
+
+// Blend between values that wrap around every period, the short way
+float lerp_wrapped(float a, float b, float t, float period)
+{
+    float d = fmod(b - a, period);
+    if (d > period / 2) d -= period;
+    if (d < -period / 2) d += period;
+    return a + d * t;
+}
+
+Vec lerp(Vec a, Vec b, float t)
+{
+    Vec ret = { lerp(a.x, b.x, t), lerp(a.y, b.y, t) };
+    return ret;
+}
+
+void snapshot(Snapshot& out, const GameState& state)
+{
+    const Entities& ents = state.entities;
+    if (out.capacity != ents.capacity)
+    {
+        const int BYTES = sizeof(EType) + sizeof(u32) + 4 * sizeof(float);
+        delete[] out.storage;
+        char* storage = out.storage = new char[ents.capacity * BYTES];
+        out.capacity = ents.capacity;
+        out.type = carve<EType>(storage, out.capacity);
+        out.born = carve<u32>(storage, out.capacity);
+        out.x = carve<float>(storage, out.capacity);
+        out.y = carve<float>(storage, out.capacity);
+        out.rotation = carve<float>(storage, out.capacity);
+        out.life = carve<float>(storage, out.capacity);
+        for (int i = 0; i < out.capacity; ++i)
+            out.type[i] = E_LAST; // matches nothing
+    }
+
+    for (EType type = E_FIRST; type < E_LAST; ++type)
+    {
+        for (int k = 0; k < ents.count[type]; ++k)
+        {
+            int i = ents.live[type][k];
+            out.type[i] = type;
+            out.born[i] = ents.born[i];
+            out.x[i] = ents.x[i];
+            out.y[i] = ents.y[i];
+            out.rotation[i] = ents.rotation[i];
+            out.life[i] = ents.life[i];
+        }
+    }
+    out.ticks = state.ticks;
+    out.player = state.player;
+    out.squarepos = state.square.pos;
+    out.squaresize = state.square.size;
+}
+
+// Draw state t of the way from the snapshot to where it is now. Ents that
+// were born since, or wrapped around the playfield, are drawn where they are.
+void interpolate(GameState& state, const Snapshot& from, float t)
+{
+    state.ticks = lerp(from.ticks, state.ticks, t);
+
+    Player& player = state.player;
+    player.pos = lerp(from.player.pos, player.pos, t);
+    player.rotation = lerp_wrapped(from.player.rotation, player.rotation, t, 2 * π);
+    player.reticle = lerp(from.player.reticle, player.reticle, t);
+    player.phase = lerp_wrapped(from.player.phase, player.phase, t, 1);
+    player.phase -= floor(player.phase);
+    state.square.pos = lerp(from.squarepos, state.square.pos, t);
+    state.square.size = lerp(from.squaresize, state.square.size, t);
+
+    Entities& ents = state.entities;
+    if (from.capacity != ents.capacity) return;
+    for (EType type = E_FIRST; type < E_LAST; ++type)
+    {
+        for (int k = 0; k < ents.count[type]; ++k)
+        {
+            int i = ents.live[type][k];
+            if (from.type[i] != type || from.born[i] != ents.born[i])
+                continue;
+            if (fabs(ents.x[i] - from.x[i]) > 1 || fabs(ents.y[i] - from.y[i]) > 1)
+                continue;
+            ents.x[i] = lerp(from.x[i], ents.x[i], t);
+            ents.y[i] = lerp(from.y[i], ents.y[i], t);
+            ents.rotation[i] = lerp_wrapped(from.rotation[i], ents.rotation[i], t, 2 * π);
+            ents.life[i] = lerp(from.life[i], ents.life[i], t);
+        }
+    }
+}
+
+// Undo interpolate, given a snapshot taken just before it
+void restore(GameState& state, const Snapshot& from)
+{
+    state.ticks = from.ticks;
+    state.player = from.player;
+    state.square.pos = from.squarepos;
+    state.square.size = from.squaresize;
+
+    Entities& ents = state.entities;
+    for (EType type = E_FIRST; type < E_LAST; ++type)
+    {
+        for (int k = 0; k < ents.count[type]; ++k)
+        {
+            int i = ents.live[type][k];
+            ents.x[i] = from.x[i];
+            ents.y[i] = from.y[i];
+            ents.rotation[i] = from.rotation[i];
+            ents.life[i] = from.life[i];
+        }
+    }
+}
+
+void release(Snapshot& snapshot)
+{
+    delete[] snapshot.storage;
+    memset(&snapshot, 0, sizeof(snapshot));
 }
 
-void init(GameState& state)
+// Same ents in the same slots, ignoring where they're stored
+bool same_entities(const Entities& a, const Entities& b)
 {
+    return a.capacity == b.capacity
+        && memcmp(a.storage, b.storage, a.capacity * SLOT_BYTES) == 0
+        && memcmp(a.count, b.count, sizeof(a.count)) == 0
+        && a.total == b.total && a.nfree == b.nfree && a.overflow == b.overflow
+        && a.serial == b.serial
+        && memcmp(a.oldest, b.oldest, sizeof(a.oldest)) == 0
+        && memcmp(a.newest, b.newest, sizeof(a.newest)) == 0
+        && memcmp(a.evicted, b.evicted, sizeof(a.evicted)) == 0
+        && memcmp(a.dropped, b.dropped, sizeof(a.dropped)) == 0
+        && a.peak == b.peak;
+}
+
+void init(GameState& state, u32 seed)
+{
+    // Start from nothing but the pool's storage
+    Entities ents = state.entities;
+    memset(&state, 0, sizeof(state));
+    state.entities = ents;
+    if (params.maxentities < params.maxenemies)
+        params.maxentities = params.maxenemies;
+    reserve_entities(state.entities, params.maxentities);
+    clear_entities(state.entities);
+
+    state.rng = seed ? seed : 1;
     state.player.size = params.playersize;
     state.player.life = 1;
     state.player.type = E_TRIANGLE;
@@ -58,9 +376,73 @@ void init(GameState& state)
     spawn_enemies(state);
 }
 
+// Move bullets, enemies and stuff, one straight loop per type
+void update_entities(GameState& state)
+{
+    Entities& ents = state.entities;
+
+    // Bullets/Rockets
+    if (state.square.attract)
+        attract_entities(state, E_BULLET);
+    for (EType t = E_BULLET; t <= E_ROCKET; ++t)
+    {
+        const int* live = ents.live[t];
+        for (int k = 0; k < ents.count[t]; ++k)
+        {
+            int i = live[k];
+            ents.life[i] -= 0.002;
+            ents.x[i] += ents.vx[i] * params.bulletspeed;
+            ents.y[i] += ents.vy[i] * params.bulletspeed;
+        }
+        for (int k = ents.count[t] - 1; k >= 0; --k)
+        {
+            int i = live[k];
+            if (ents.x[i] > 1 || ents.x[i] < -1 || ents.y[i] > 1 || ents.y[i] < -1)
+                destroy_entity(state, i);
+            else if (ents.life[i] <= 0)
+                free_entity(state, i);
+        }
+    }
+
+    // Turds & Novae
+    for (EType t = E_TURD; t <= E_NOVA; ++t)
+    {
+        const int* live = ents.live[t];
+        for (int k = 0; k < ents.count[t]; ++k)
+            ents.life[live[k]] -= 0.01;
+        for (int k = ents.count[t] - 1; k >= 0; --k)
+            if (ents.life[live[k]] <= 0)
+                free_entity(state, live[k]);
+    }
+
+    // Enemies/XP Chunks
+    for (EType t = E_ENEMY; t <= E_XPCHUNK; ++t)
+    {
+        const int* live = ents.live[t];
+        for (int k = 0; k < ents.count[t]; ++k)
+        {
+            int i = live[k];
+
+            // Move
+            ents.x[i] += ents.vx[i] * params.enemyspeed;
+            ents.y[i] += ents.vy[i] * params.enemyspeed;
+
+            // Wrap
+            if (ents.x[i] < -1.0) ents.x[i] += 2.0;
+            if (ents.y[i] < -1.0) ents.y[i] += 2.0;
+            if (ents.x[i] > 1.0) ents.x[i] -= 2.0;
+            if (ents.y[i] > 1.0) ents.y[i] -= 2.0;
+        }
+
+        // Attract
+        if (state.square.attract)
+            attract_entities(state, t);
+    }
+}
+
 void update(GameState& state, u32 ticks, bool debug, const Input& input)
 {
-    GameState previousState = state;
+    Previous previous = { state.square.pos };
 
     // HACK TODO
     if (input.respawn && entity_count(state) == 0)
@@ -157,53 +539,14 @@ void update(GameState& state, u32 ticks, bool debug, const Input& input)
     }
 
     // Process entities
-    for (int i = 0; i < MAX_ENTITIES; ++i)
-    {
-        Entity& e = state.entities[i];
-        if (e.life <= 0) continue;
-
-        switch (e.type)
-        {
-        // Bullets/Rockets
-        case E_BULLET:
-            attract_entity(state, e);
-        case E_ROCKET:
-            e.life -= 0.002;
-            e.pos += e.vel * params.bulletspeed;
-            if (e.pos.x > 1 || e.pos.x < -1 || e.pos.y > 1 || e.pos.y < -1)
-                destroy_entity(state, e);
-            continue;
-
-        // Turds & Novae
-        case E_TURD:
-        case E_NOVA:
-            e.life -= 0.01;
-            continue;
-
-        // Enemies/XP Chunks
-        case E_ENEMY:
-            /* e.hue += 0.01; */
-        case E_XPCHUNK:
-            // Move
-            e.pos += e.vel * params.enemyspeed;
-
-            // Wrap
-            if (e.pos.x < -1.0) e.pos.x += 2.0;
-            if (e.pos.y < -1.0) e.pos.y += 2.0;
-            if (e.pos.x > 1.0) e.pos.x -= 2.0;
-            if (e.pos.y > 1.0) e.pos.y -= 2.0;
-
-            // Attract
-            attract_entity(state, e);
-            continue;
-
-        default:
-            ;
-        }
-    }
+    update_entities(state);
 
     // Collisions
-    collide(state, previousState);
+    if (debug)
+        check_broadphase(state);
+    profile::begin(P_COLLIDE);
+    collide(state, previous);
+    profile::end(P_COLLIDE);
 
     // Game Over
     if (state.player.size <= 0)
@@ -214,28 +557,27 @@ void update(GameState& state, u32 ticks, bool debug, const Input& input)
 // (Re)spawn enemies
 void spawn_enemies(GameState& state)
 {
-    int count = minimum(state.player.killcount + 1, MAX_ENEMIES);
+    int count = minimum(state.player.killcount + 1, params.maxenemies);
     for (int i = 0; i < count; ++i)
     {
         Entity e = {0};
         e.type = E_ENEMY;
-        float mag = normrand() / 4.0 + 0.75;
-        float angle = normrand() * M_PI * 2;
+        float mag = normrand(state.rng) / 4.0 + 0.75;
+        float angle = normrand(state.rng) * M_PI * 2;
         e.pos.x = mag * cos(angle);
         e.pos.y = mag * sin(angle);
         e.vel = e.pos * 0.5;
         e.life = 1.0;
-        e.hue = (rand() % 360) / 360.0;
+        e.hue = (xorshift(state.rng) % 360) / 360.0;
         add_entity(state, e);
     }
 }
 
 
-bool check_square_collision(GameState::_Square& square, Entity& e)
+bool check_square_collision(const GameState::_Square& square, float x, float y)
 {
-    Vec offset = e.pos - square.pos;
     float sz = square.size / 2;
-    if (fabs(offset.x) < sz && fabs(offset.y) < sz)
+    if (fabs(x - square.pos.x) < sz && fabs(y - square.pos.y) < sz)
     {
       return true;
     }
@@ -243,55 +585,143 @@ bool check_square_collision(GameState::_Square& square, Entity& e)
     return false;
 }
 
-bool check_collision(Entity& a, Entity& b)
+bool check_collision(const Entities& ents, int a, int b)
 {
     // skip dead ents
-    if (a.life <= 0 || b.life <= 0) return false;
+    if (ents.life[a] <= 0 || ents.life[b] <= 0) return false;
 
     // TODO variable hitbxes
-    if (mag_squared(a.pos - b.pos) < params.hitbox)
+    float dx = ents.x[a] - ents.x[b];
+    float dy = ents.y[a] - ents.y[b];
+    if (dx * dx + dy * dy < params.hitbox)
     {
         return true;
     }
     return false;
 }
 
-void record_event(GameState& state, Event& evt)
+// Put a slot on the end of its type's live list, as the newest of its type
+void link_entity(Entities& ents, int id)
+{
+    EType t = ents.type[id];
+    ents.index[id] = ents.count[t];
+    ents.live[t][ents.count[t]++] = id;
+    ++ents.total;
+    if (ents.total > ents.peak)
+        ents.peak = ents.total;
+
+    ents.born[id] = ents.serial++;
+    ents.older[id] = ents.newest[t];
+    ents.newer[id] = -1;
+    if (ents.newest[t] >= 0)
+        ents.newer[ents.newest[t]] = id;
+    else
+        ents.oldest[t] = id;
+    ents.newest[t] = id;
+}
+
+// Take a slot off its type's live list, filling the hole with the last one
+void unlink_entity(Entities& ents, int id)
+{
+    EType t = ents.type[id];
+    int k = ents.index[id];
+    int last = ents.live[t][--ents.count[t]];
+    ents.live[t][k] = last;
+    ents.index[last] = k;
+    ents.index[id] = -1;
+    --ents.total;
+
+    if (ents.older[id] >= 0)
+        ents.newer[ents.older[id]] = ents.newer[id];
+    else
+        ents.oldest[t] = ents.newer[id];
+    if (ents.newer[id] >= 0)
+        ents.older[ents.newer[id]] = ents.older[id];
+    else
+        ents.newest[t] = ents.older[id];
+}
+
+// Quietly let an ent go, e.g. when it fizzles out
+void free_entity(GameState& state, int id)
+{
+    Entities& ents = state.entities;
+    ents.life[id] = 0;
+    if (ents.index[id] < 0) return;
+    unlink_entity(ents, id);
+    ents.free[ents.nfree++] = id;
+}
+
+// Make room for an ent of the given type. Enemies are never evicted.
+int evict_entity(GameState& state, EType type)
 {
-    int i = state.next_event++;
-    if (i >= MAX_EVENTS) return; // TODO
+    Entities& ents = state.entities;
+    int victim = type == E_ENEMY ? -1 : ents.oldest[type];
+    if (victim < 0)
+    {
+        for (EType t = E_FIRST; t < E_LAST; ++t)
+        {
+            int candidate = ents.oldest[t];
+            if (t == E_ENEMY || candidate < 0) continue;
+            if (victim < 0 || ents.born[candidate] < ents.born[victim])
+                victim = candidate;
+        }
+    }
+    if (victim < 0) return -1;
 
-    state.events[i] = evt;
+    ++ents.evicted[ents.type[victim]];
+    free_entity(state, victim);
+    return victim;
 }
 
-void add_entity(GameState& state, Entity& e)
+// Returns the new ent's slot, or -1 if there was no room for it
+int add_entity(GameState& state, Entity& e)
 {
-    // find next fungible (not-enemy) ent
-    do ++state.next %= MAX_ENTITIES;
-    while (state.entities[state.next].type == E_ENEMY);
-    state.entities[state.next] = e;
+    Entities& ents = state.entities;
+
+    if (ents.nfree == 0)
+    {
+        if (ents.overflow == OVERFLOW_DROP || evict_entity(state, e.type) < 0)
+        {
+            ++ents.dropped[e.type];
+            return -1;
+        }
+    }
+
+    int id = ents.free[--ents.nfree];
+    ents.type[id] = e.type;
+    ents.life[id] = e.life;
+    ents.x[id] = e.pos.x;
+    ents.y[id] = e.pos.y;
+    ents.vx[id] = e.vel.x;
+    ents.vy[id] = e.vel.y;
+    ents.rotation[id] = e.rotation;
+    ents.hue[id] = e.hue;
+    link_entity(ents, id);
 
     // Propogate event for gfx/audio
-    Event evt;
-    evt.type = Event::T_ENT_CREATED;
-    evt.entity = e.type;
-    record_event(state, evt);
+    Event evt = { Event::T_ENT_CREATED, e.type, e.pos, e.hue, 0 };
+    events::emit(evt);
 
+    return id;
 }
 
-void destroy_entity(GameState& state, Entity& e)
+void destroy_entity(GameState& state, int id)
 {
-    if (e.life == 0) warn("Killing dead ent\n");
+    Entities& ents = state.entities;
+    if (ents.life[id] == 0) warn("Killing dead ent\n");
 
-    e.life = 0;
+    // Hang on to what we need, the slot is up for grabs once it's freed
+    EType type = ents.type[id];
+    Vec pos = {ents.x[id], ents.y[id]};
+    Vec vel = {ents.vx[id], ents.vy[id]};
+    float hue = ents.hue[id];
+    free_entity(state, id);
 
     // Propogate event for gfx/audio
-    Event evt;
-    evt.type = Event::T_ENT_DESTROYED;
-    evt.entity = e.type;
-    record_event(state, evt);
+    Event evt = { Event::T_ENT_DESTROYED, type, pos, hue, 0 };
+    events::emit(evt);
 
-    if (e.type == E_ENEMY)
+    if (type == E_ENEMY)
     {
         ++state.player.killcount;
         if (state.ticks - state.player.lastkill < beats_per_minute(state))
@@ -304,11 +734,11 @@ void destroy_entity(GameState& state, Entity& e)
         {
             Entity xp = {0};
             xp.type = E_XPCHUNK;
-            xp.pos = e.pos;
-            xp.vel.x = e.vel.x + normrand() * 0.5;
-            xp.vel.y = e.vel.y + normrand() * 0.5;
+            xp.pos = pos;
+            xp.vel.x = vel.x + normrand(state.rng) * 0.5;
+            xp.vel.y = vel.y + normrand(state.rng) * 0.5;
             xp.life = 1;
-            xp.hue = e.hue;
+            xp.hue = hue;
             add_entity(state, xp);
         }
     }
@@ -321,96 +751,361 @@ void destroy_entity(GameState& state, Entity& e)
     }
 }
 
-void hurt_entity(GameState& state, Entity& e, float damage)
+void hurt_entity(GameState& state, int id, float damage)
 {
-    e.life -= damage;
-    if (e.life <= 0)
+    state.entities.life[id] -= damage;
+    if (state.entities.life[id] <= 0)
     {
-        destroy_entity(state, e);
+        destroy_entity(state, id);
     }
 }
 
-void collide(GameState& state, const GameState& previousState)
+// Hurt an enemy with a projectile
+void hit_enemy(GameState& state, int id, float damage)
 {
-    // Check ent-ent collisions
-    for (int i =   0; i < MAX_ENTITIES; ++i)
-        for (int j = i+1; j < MAX_ENTITIES; ++j)
-        {
-            Entity& a = state.entities[i];
-            Entity& b = state.entities[j];
-            if (check_collision(a, b))
-            {
+    const Entities& ents = state.entities;
+    Event evt = { Event::T_ENT_HIT, E_ENEMY, {ents.x[id], ents.y[id]}, ents.hue[id], damage };
+    hurt_entity(state, id, damage);
+    events::emit(evt);
+}
+
+// Resolve a (possibly) colliding pair of ents
+void collide_pair(GameState& state, int a, int b)
+{
+    if (!check_collision(state.entities, a, b)) return;
+
+    const EType* type = state.entities.type;
 // XXX Lord this is hackish. Hao fix?
-#define WHEN_COLLIDE(type1, type2) if ((a.type == type1 && b.type == type2 )|| (a.type == type2 && b.type == type1))
-#define THEN_THE(type1) (a.type == type1 ? a : b)
-                WHEN_COLLIDE(E_TURD, E_ENEMY)
-                {
-                    destroy_entity(state, THEN_THE(E_TURD));
-                    hurt_entity(state, THEN_THE(E_ENEMY), 0.1);
-                    Event evt;
-                    evt.type = Event::T_ENT_HIT;
-                    evt.entity = E_ENEMY;
-                    record_event(state, evt);
-                }
-                WHEN_COLLIDE(E_BULLET, E_ENEMY)
-                {
-                    destroy_entity(state, THEN_THE(E_BULLET));
-                    hurt_entity(state, THEN_THE(E_ENEMY), 0.1);
-                    Event evt;
-                    evt.type = Event::T_ENT_HIT;
-                    evt.entity = E_ENEMY;
-                    record_event(state, evt);
-                }
-                WHEN_COLLIDE(E_ROCKET, E_ENEMY)
-                {
-                    destroy_entity(state, THEN_THE(E_ROCKET));
-                    hurt_entity(state, THEN_THE(E_ENEMY), 0.5);
-                    Event evt;
-                    evt.type = Event::T_ENT_HIT;
-                    evt.entity = E_ENEMY;
-                    record_event(state, evt);
-                }
+#define WHEN_COLLIDE(type1, type2) if ((type[a] == type1 && type[b] == type2 )|| (type[a] == type2 && type[b] == type1))
+#define THEN_THE(type1) (type[a] == type1 ? a : b)
+    WHEN_COLLIDE(E_TURD, E_ENEMY)
+    {
+        destroy_entity(state, THEN_THE(E_TURD));
+        hit_enemy(state, THEN_THE(E_ENEMY), 0.1);
+    }
+    WHEN_COLLIDE(E_BULLET, E_ENEMY)
+    {
+        destroy_entity(state, THEN_THE(E_BULLET));
+        hit_enemy(state, THEN_THE(E_ENEMY), 0.1);
+    }
+    WHEN_COLLIDE(E_ROCKET, E_ENEMY)
+    {
+        destroy_entity(state, THEN_THE(E_ROCKET));
+        hit_enemy(state, THEN_THE(E_ENEMY), 0.5);
+    }
 #undef WHEN_COLLIDE
 #undef THEN_THE
-            }
+}
+
+// Check ent-ent collisions the slow way. Kept around as the reference the
+// broadphase has to agree with.
+void collide_entities_reference(GameState& state)
+{
+    int capacity = state.entities.capacity;
+    for (int i =   0; i < capacity; ++i)
+        for (int j = i+1; j < capacity; ++j)
+            collide_pair(state, i, j);
+}
+
+// Uniform grid over the [-1,1] playfield. Cells are at least one hitbox
+// wide, so anything that can collide is in the same or a neighbouring cell.
+// Projectiles and enemies get a bucket each per cell, since those are the
+// only pairs that react. Rebuilt from scratch every tick; the colliders are
+// sorted by slot once, then bucketed with a counting sort in that order.
+const int MAX_GRID_DIM = 256;
+
+enum { G_PROJECTILE, G_ENEMY };
+
+struct _Grid {
+    int dim;
+    float cellsize;
+    int count; // ents in the grid
+    int capacity; // slots the arrays below have room for
+    int* order; // their slots, ascending
+    int* cell; // cell of each slot in the grid
+    int* at; // where each slot is in its bucket
+    unsigned char* kind; // and which of them it's in
+    int start[2][MAX_GRID_DIM * MAX_GRID_DIM + 1]; // first item of each cell
+    int* items[2]; // slots, bucketed by cell, ascending in each
+    float* x[2]; // and their positions, to scan without chasing slots
+    float* y[2];
+    int fill[MAX_GRID_DIM * MAX_GRID_DIM]; // scratch for bucketing
+} grid;
+
+// Only these ever react to bumping into each other
+const EType COLLIDERS[] = { E_BULLET, E_ROCKET, E_TURD, E_ENEMY };
+const int NCOLLIDERS = sizeof(COLLIDERS) / sizeof(*COLLIDERS);
+
+int grid_coord(float f)
+{
+    int c = (int)floor((f + 1) / grid.cellsize);
+    if (c < 0) return 0;
+    if (c >= grid.dim) return grid.dim - 1;
+    return c;
+}
+
+void bucket(const Entities& ents, int which)
+{
+    const EType* type = ents.type;
+    int cells = grid.dim * grid.dim;
+    int* start = grid.start[which];
+    memset(start, 0, (cells + 1) * sizeof(int));
+    for (int k = 0; k < grid.count; ++k)
+    {
+        int i = grid.order[k];
+        if ((type[i] == E_ENEMY) == (which == G_ENEMY))
+            ++start[grid.cell[i] + 1];
+    }
+    for (int c = 0; c < cells; ++c)
+        start[c + 1] += start[c];
+
+    // Fill in slot order so every cell's bucket ends up sorted
+    memcpy(grid.fill, start, cells * sizeof(int));
+    for (int k = 0; k < grid.count; ++k)
+    {
+        int i = grid.order[k];
+        if ((type[i] == E_ENEMY) != (which == G_ENEMY))
+            continue;
+        int n = grid.fill[grid.cell[i]]++;
+        grid.items[which][n] = i;
+        grid.at[i] = n;
+        grid.kind[i] = which;
+        grid.x[which][n] = ents.x[i];
+        grid.y[which][n] = ents.y[i];
+    }
+}
+
+void build_grid(const GameState& state)
+{
+    const Entities& ents = state.entities;
+
+    if (grid.capacity < ents.capacity)
+    {
+        delete[] grid.order;
+        delete[] grid.cell;
+        delete[] grid.at;
+        delete[] grid.kind;
+        grid.capacity = ents.capacity;
+        grid.order = new int[grid.capacity];
+        grid.cell = new int[grid.capacity];
+        grid.at = new int[grid.capacity];
+        grid.kind = new unsigned char[grid.capacity];
+        for (int w = G_PROJECTILE; w <= G_ENEMY; ++w)
+        {
+            delete[] grid.items[w];
+            delete[] grid.x[w];
+            delete[] grid.y[w];
+            grid.items[w] = new int[grid.capacity];
+            grid.x[w] = new float[grid.capacity];
+            grid.y[w] = new float[grid.capacity];
         }
+    }
 
-    // Handle player collisions
-    for (int i = 0; i < MAX_ENTITIES; ++i)
+    // Clamped as a float, since a tiny or bad hitbox won't fit in an int
+    float dim = 2 / sqrt(params.hitbox);
+    grid.dim = dim >= MAX_GRID_DIM ? MAX_GRID_DIM : dim >= 1 ? (int)dim : 1;
+    grid.cellsize = 2.0 / grid.dim;
+
+    grid.count = 0;
+    for (int t = 0; t < NCOLLIDERS; ++t)
     {
-        Entity& e = state.entities[i];
+        const int* live = ents.live[COLLIDERS[t]];
+        for (int k = 0; k < ents.count[COLLIDERS[t]]; ++k)
+        {
+            int i = live[k];
+            grid.order[grid.count++] = i;
+            grid.cell[i] = grid_coord(ents.y[i]) * grid.dim + grid_coord(ents.x[i]);
+        }
+    }
+    sort(grid.order, grid.order + grid.count);
+
+    bucket(ents, G_PROJECTILE);
+    bucket(ents, G_ENEMY);
+}
+
+// First item from k on in a bucket close enough to (x, y) to touch, or end.
+// The same sum check_collision does, so nothing that touches is skipped.
+// Items that have been used up have a NaN position, which never touches.
+int next_touching(int which, int k, int end, float x, float y)
+{
+    const float* bx = grid.x[which];
+    const float* by = grid.y[which];
+    for (; k < end; ++k)
+    {
+        float dx = x - bx[k];
+        float dy = y - by[k];
+        if (dx * dx + dy * dy < params.hitbox)
+            break;
+    }
+    return k;
+}
+
+// Whether slot i still holds a live ent of the kind it was bucketed as.
+// Ents get freed partway through, and their slots handed out again.
+bool still_there(const Entities& ents, int i)
+{
+    if (ents.life[i] <= 0) return false;
+    EType type = ents.type[i];
+    if (grid.kind[i] == G_ENEMY)
+        return type == E_ENEMY;
+    return type == E_BULLET || type == E_ROCKET || type == E_TURD;
+}
+
+// Gone, so nothing needs to look at it again
+void retire(int i)
+{
+    grid.x[grid.kind[i]][grid.at[i]] = NAN;
+}
+
+// Resolve i against the ents of the other kind after it in the cells around
+// it, lowest slot first, as the reference loop gets to them. The buckets are
+// in slot order already, so the ones close enough to touch are merged.
+// Stops once i is gone.
+void collide_neighbours(GameState& state, int i)
+{
+    const Entities& ents = state.entities;
+    int which = !grid.kind[i];
+    const int* items = grid.items[which];
+    const int* start = grid.start[which];
+    float x = ents.x[i];
+    float y = ents.y[i];
+    int head[9];
+    int end[9];
+    int heads = 0;
+
+    int cx = grid.cell[i] % grid.dim;
+    int cy = grid.cell[i] / grid.dim;
+    for (int gy = maximum(cy - 1, 0); gy <= minimum(cy + 1, grid.dim - 1); ++gy)
+        for (int gx = maximum(cx - 1, 0); gx <= minimum(cx + 1, grid.dim - 1); ++gx)
+        {
+            int c = gy * grid.dim + gx;
+            int k = std::upper_bound(items + start[c], items + start[c + 1], i) - items;
+            head[heads] = next_touching(which, k, start[c + 1], x, y);
+            end[heads] = start[c + 1];
+            if (head[heads] < end[heads])
+                ++heads;
+        }
+
+    while (heads && still_there(ents, i))
+    {
+        int next = 0;
+        for (int h = 1; h < heads; ++h)
+            if (items[head[h]] < items[head[next]])
+                next = h;
+        int j = items[head[next]];
+        collide_pair(state, i, j);
+        if (!still_there(ents, j))
+            retire(j);
+        head[next] = next_touching(which, head[next] + 1, end[next], x, y);
+        if (head[next] == end[next])
+        {
+            --heads;
+            head[next] = head[heads];
+            end[next] = end[heads];
+        }
+    }
+    if (!still_there(ents, i))
+        retire(i);
+}
+
+// Check ent-ent collisions, only testing projectiles against enemies in
+// neighbouring cells. Pairs are visited in the same (i, j) order as the
+// reference loop, so the same ents get hit in the same order.
+void collide_entities(GameState& state)
+{
+    build_grid(state);
+
+    for (int n = 0; n < grid.count; ++n)
+    {
+        int i = grid.order[n];
+        if (still_there(state.entities, i))
+            collide_neighbours(state, i);
+    }
+}
+
+// Run both the broadphase and the reference loop on copies of the state and
+// make sure they end up in the same place.
+bool check_broadphase(const GameState& state)
+{
+    GameState* expected = new GameState();
+    GameState* actual = new GameState();
+    copy(*expected, state);
+    copy(*actual, state);
+
+    // Both runs emit into the frame's events; keep the first run's aside
+    // and take them all back out afterwards
+    int mark = events::count();
+    collide_entities_reference(*expected);
+    int n = events::count() - mark;
+    Event* expected_events = new Event[n];
+    for (int i = 0; i < n; ++i)
+        expected_events[i] = events::get(mark + i);
+    events::truncate(mark);
+
+    collide_entities(*actual);
+
+    bool same = same_entities(expected->entities, actual->entities)
+             && events::count() - mark == n;
+    for (int i = 0; same && i < n; ++i)
+        same = memcmp(&expected_events[i], &events::get(mark + i), sizeof(Event)) == 0;
+    if (!same)
+        warn("Broadphase disagrees with reference collision loop");
+    events::truncate(mark);
+
+    delete[] expected_events;
+    release(*expected);
+    release(*actual);
+    delete expected;
+    delete actual;
+    return same;
+}
 
-        // skip dead ents
-        if (e.life <= 0) continue;
+void collide(GameState& state, const Previous& previous)
+{
+    // Check ent-ent collisions
+    collide_entities(state);
+
+    // Handle player collisions
+    Entities& ents = state.entities;
+    for (EType type = E_FIRST; type < E_LAST; ++type)
+    for (int k = ents.count[type] - 1; k >= 0; --k)
+    {
+        int i = ents.live[type][k];
 
         // collide ents with square
-        if (check_square_collision(state.square, e))
+        if (check_square_collision(state.square, ents.x[i], ents.y[i]))
         {
-            if (e.type == E_BULLET) // bullets are absorbed
+            if (type == E_BULLET) // bullets are absorbed
             {
                 state.square.size *= params.squaregrowth;
-                destroy_entity(state, e);
+                destroy_entity(state, i);
+                continue;
             }
-            if (e.type == E_ROCKET) // rockets bounce
+            if (type == E_ROCKET) // rockets bounce
             {
-                e.vel.x = -e.vel.x;
-                e.vel.y = -e.vel.y;
+                ents.vx[i] = -ents.vx[i];
+                ents.vy[i] = -ents.vy[i];
             }
-            if (e.type == E_TURD) // turds block square
+            if (type == E_TURD) // turds block square
             {
-                state.square.pos = previousState.square.pos;
+                state.square.pos = previous.squarepos;
             }
-            if (e.type == E_ENEMY) // enemies block square
+            if (type == E_ENEMY) // enemies block square
             {
-                e.vel = -e.vel;
-                bml::negate(e.vel);
+                Vec vel = {ents.vx[i], ents.vy[i]};
+                vel = -vel;
+                bml::negate(vel);
+                ents.vx[i] = vel.x;
+                ents.vy[i] = vel.y;
             }
-            if (e.type == E_XPCHUNK)
+            if (type == E_XPCHUNK)
             {
                 // Check top intersection
                 float length = state.square.size;
-                Vec p = e.pos - e.vel;
-                Vec r = e.vel;
+                Vec pos = {ents.x[i], ents.y[i]};
+                Vec vel = {ents.vx[i], ents.vy[i]};
+                Vec p = pos - vel;
+                Vec r = vel;
                 Vec qtop = {state.square.pos.x - length / 2, state.square.pos.y + length / 2};
                 Vec qbottom = {state.square.pos.x + length / 2, state.square.pos.y - length / 2};
                 Vec sx = UNIT_X * length;
@@ -419,41 +1114,43 @@ void collide(GameState& state, const GameState& previousState)
                 float t = -1;
                 if ((t = check_segment_intersection(p, qtop, r, sx)) > 0)
                 {
-                    e.vel.y = -e.vel.y;
-                    e.pos.y += e.vel.y * t * 2 * params.enemyspeed;
+                    ents.vy[i] = -ents.vy[i];
+                    ents.y[i] += ents.vy[i] * t * 2 * params.enemyspeed;
                 }
                 else if ((t = check_segment_intersection(p, qtop, r, -sy)) > 0)
                 {
-                    e.vel.x = -e.vel.x;
-                    e.pos.x += e.vel.x * t * 2 * params.enemyspeed;
+                    ents.vx[i] = -ents.vx[i];
+                    ents.x[i] += ents.vx[i] * t * 2 * params.enemyspeed;
                 }
                 else if ((t = check_segment_intersection(p, qbottom, r, -sx)) > 0)
                 {
-                    e.vel.y = -e.vel.y;
-                    e.pos.y += e.vel.y * t * 2 * params.enemyspeed;
+                    ents.vy[i] = -ents.vy[i];
+                    ents.y[i] += ents.vy[i] * t * 2 * params.enemyspeed;
                 }
                 else if ((t = check_segment_intersection(p, qbottom, r, sy)) > 0)
                 {
-                    e.vel.x = -e.vel.x;
-                    e.pos.x += e.vel.x * t * 2 * params.enemyspeed;
+                    ents.vx[i] = -ents.vx[i];
+                    ents.x[i] += ents.vx[i] * t * 2 * params.enemyspeed;
                 }
 
             }
 
         }
 
-        if (mag_squared(e.pos - state.player.pos) < params.hitbox)
+        float dx = ents.x[i] - state.player.pos.x;
+        float dy = ents.y[i] - state.player.pos.y;
+        if (dx * dx + dy * dy < params.hitbox)
         {
             // Collect xp to grow
-            if (e.type == E_XPCHUNK)
+            if (type == E_XPCHUNK)
             {
                 state.player.size *= 1.05;
                 state.player.life += 0.05;
-                destroy_entity(state, e);
+                destroy_entity(state, i);
             }
 
             // Enemies cause shrinkage
-            else if (e.type == E_ENEMY)
+            else if (type == E_ENEMY)
             {
                 if (state.player.size <= 1)
                     ;//state.player.size -= 0.1;
@@ -467,6 +1164,56 @@ void collide(GameState& state, const GameState& previousState)
     }
 }
 
+// FNV-1a
+void hash_bytes(u32& hash, const void* data, size_t size)
+{
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+}
+
+// Fingerprint everything gameplay depends on, to tell whether two runs
+// have diverged
+u32 hash(const GameState& state)
+{
+    u32 ret = 2166136261u;
+    hash_bytes(ret, &state.ticks, sizeof(state.ticks));
+    hash_bytes(ret, &state.rng, sizeof(state.rng));
+    hash_bytes(ret, &state.player, sizeof(state.player));
+    hash_bytes(ret, &state.square.pos, sizeof(state.square.pos));
+    hash_bytes(ret, &state.square.size, sizeof(state.square.size));
+
+    const Entities& ents = state.entities;
+    for (EType t = E_FIRST; t < E_LAST; ++t)
+    {
+        hash_bytes(ret, &ents.count[t], sizeof(int));
+        for (int k = 0; k < ents.count[t]; ++k)
+        {
+            int i = ents.live[t][k];
+            float fields[] = {
+                ents.life[i], ents.x[i], ents.y[i], ents.vx[i], ents.vy[i], ents.rotation[i], ents.hue[i]
+            };
+            hash_bytes(ret, &i, sizeof(i));
+            hash_bytes(ret, fields, sizeof(fields));
+        }
+    }
+    return ret;
+}
+
+void print_stats(const GameState& state)
+{
+    const Entities& ents = state.entities;
+    logger << "Entity pool: " << ents.peak << '/' << ents.capacity << " peak" << std::endl;
+    for (EType t = E_FIRST; t < E_LAST; ++t)
+    {
+        if (ents.evicted[t] || ents.dropped[t])
+            logger << "  type " << t << ": " << ents.evicted[t] << " evicted, " << ents.dropped[t] << " dropped" << std::endl;
+    }
+}
+
 bool spend_life(GameState& state, float cost)
 {
     if (state.player.life < cost) return false;
@@ -474,13 +1221,20 @@ bool spend_life(GameState& state, float cost)
     return true;
 }
 
-void attract_entity(GameState& state, Entity& e)
+void attract_entities(GameState& state, EType type)
 {
-    if (state.square.attract)
+    Entities& ents = state.entities;
+    const int* live = ents.live[type];
+    float gravity = params.squaregravity;
+    for (int k = 0; k < ents.count[type]; ++k)
     {
-        Vec offset = e.pos - state.square.pos;
-        e.pos -= offset * params.squaregravity;
-        e.vel -= offset * params.squaregravity;
+        int i = live[k];
+        float dx = (ents.x[i] - state.square.pos.x) * gravity;
+        float dy = (ents.y[i] - state.square.pos.y) * gravity;
+        ents.x[i] -= dx;
+        ents.y[i] -= dy;
+        ents.vx[i] -= dx;
+        ents.vy[i] -= dy;
     }
 }
 
@@ -1,4 +1,7 @@
 #include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <cstdlib>
 #include "GL/glew.h"
 #include "crossgl.h"
 #include "vec.h"
@@ -47,6 +50,13 @@ GLuint CreateProgram(GLuint vertex, GLuint fragment)
     glAttachShader(program, vertex);
     glAttachShader(program, fragment);
 
+    // Pin attribute locations, so one set of pointers works for every program
+    glBindAttribLocation(program, 0, "inPos");
+    glBindAttribLocation(program, 1, "inOffset");
+    glBindAttribLocation(program, 2, "inRotation");
+    glBindAttribLocation(program, 3, "inScale");
+    glBindAttribLocation(program, 4, "inHue");
+
     glLinkProgram(program);
 
     GLint status;
@@ -73,66 +83,210 @@ GLuint CreateProgram(GLuint vertex, GLuint fragment)
 namespace gfx
 {
 
-typedef union Vertex {
-    float a[4];
-    struct {
-        float x;
-        float y;
-        float z;
-        float w;
-    };
-} Vertex;
-
-template<int N>
-union VertexBuffer {
-    float flat[4 * N];
-    Vertex v[N];
-};
-
+// A mesh's triangles in the geometry buffer, size indices from first on
 typedef struct _VBO {
-    GLuint handle;
+    GLint first;
     GLsizei size;
 } VBO;
 
+// Uniforms our shaders use, looked up once per program at link time
+enum Uniform {
+    U_OFFSET,
+    U_ROTATION,
+    U_TICKS,
+    U_SCALE,
+    U_PHASE,
+    U_VALUE,
+    U_HUE,
+    U_CENTER,
+    U_RADIUS,
+    U_PERCENT,
+    U_DIR,
+    U_TEXSOURCE,
+    U_TEXTURESIZE,
+    U_SIZE,
+    U_TEXBLOOM,
+    U_LAST
+};
+
+const char* UNIFORM_NAMES[U_LAST] = {
+    "offset",
+    "rotation",
+    "ticks",
+    "scale",
+    "phase",
+    "value",
+    "hue",
+    "center",
+    "radius",
+    "percent",
+    "dir",
+    "texSource",
+    "textureSize",
+    "size",
+    "texBloom",
+};
+
+typedef struct _Shader {
+    GLuint handle;
+    GLint uniforms[U_LAST]; // -1 if the program doesn't use it
+} Shader;
+
+// Per-instance attributes for instanced entity draws
+typedef struct _Instance {
+    float x;
+    float y;
+    float rotation;
+    float scale;
+    float hue;
+} Instance;
+
+// Vertex already placed on screen by the CPU, for streamed batches
+typedef struct _StreamVertex {
+    float x;
+    float y;
+    float hue;
+} StreamVertex;
+
+// A mesh's corners, each once, and the triangles between them. The
+// shaders make positions out of the 2 floats a corner has.
+typedef struct _Mesh {
+    float* vertices; // 2 floats each
+    uint16_t* indices; // 3 per triangle
+    int nvertices;
+    int size; // indices
+} Mesh;
+
+// Attribute locations, see arcsynthesis::CreateProgram
+enum {
+    A_POSITION,
+    A_OFFSET,
+    A_ROTATION,
+    A_SCALE,
+    A_HUE,
+    A_LAST
+};
+
+// The ways we feed vertices to GL. Each is a VAO if the driver has them,
+// otherwise its pointers are set up again whenever it's used.
+enum {
+    VA_STATIC, // the geometry buffer
+    VA_INSTANCED, // the geometry buffer, plus an Instance each
+    VA_STREAM, // the stream
+    VA_LAST
+};
+
+// Texture formats for render targets
+enum {
+    FBO_RGBA8,
+    FBO_RGBA16F, // for adding up glow past 1, if the driver has it
+};
+
 typedef struct _FBO {
     GLuint handle;
     GLuint texture;
     float width;
     float height;
+    int format;
 } FBO;
 
+// Render targets, handed out again to whoever wants the same size and
+// format. Ones nobody has asked for since the last trim are deleted then,
+// so resizing doesn't pile them up.
+const int MAX_FBOS = 16;
+
+typedef struct _FBOPool {
+    FBO fbos[MAX_FBOS];
+    bool used[MAX_FBOS];
+    int count;
+    size_t bytes; // texture memory held
+    size_t peak;
+    int made; // over the run
+    int deleted;
+} FBOPool;
+
+// How much the glow costs. Higher levels blur at more resolutions,
+// which spreads it further and smoother.
+enum {
+    GLOW_OFF,
+    GLOW_LOW, // 1/4 size
+    GLOW_MEDIUM, // 1/2 and 1/4
+    GLOW_HIGH, // 1/2, 1/4 and 1/8
+    GLOW_LAST
+};
+
+const char* GLOW_NAMES[GLOW_LAST] = { "off", "low", "medium", "high" };
+const int BLOOM_LEVELS = 3;
+const float BLOOM_STRENGTH = 1.0;
+
 typedef struct _RenderState {
     struct _Shaders {
-        GLuint player;
-        GLuint square;
-        GLuint reticle;
-        GLuint meter;
-
-        GLuint enemy;
-        GLuint turd;
-        GLuint viewport;
-        GLuint nova;
-        GLuint xpchunk;
-
-        GLuint post_blur;
-        GLuint post_fade;
+        Shader player;
+        Shader square;
+        Shader reticle;
+        Shader meter;
+
+        Shader enemy;
+        Shader turd;
+        Shader viewport;
+        Shader nova;
+        Shader xpchunk;
+
+        Shader post_fade;
+        Shader bloom_resample;
+        Shader bloom_blur;
+        Shader bloom_composite;
+
+        Shader profile;
+
+        // Variants that draw a whole batch of ents at once, taking
+        // offset/rotation/scale/hue per instance, or per vertex if streamed
+        Shader bullet_batch;
+        Shader turd_batch;
+        Shader enemy_batch;
+        Shader xpchunk_batch;
     } shaders;
 
-    // VBO for each major ent type
+    // Batches are drawn instanced if the driver can, otherwise the CPU
+    // transforms them into the stream
+    bool instancing;
+    GLuint instances; // streamed every frame
+
+    // Copies of the meshes batches use, for transforming on the CPU
+    struct _Meshes {
+        Mesh player;
+        Mesh enemy;
+    } mesh;
+
+    // Where each mesh is in the geometry buffer
     struct _VBOs {
         VBO enemy;
         VBO player;
         VBO square;
         VBO nova;
         VBO reticle;
-        VBO viewport;
+        VBO fullscreen;
+        VBO quad;
     } vbo;
 
-    // Two framebuffers for two-pass glow
+    // The window, the scene drawn offscreen at the window's size when it
+    // glows, and the bloom chain at 1/2, 1/4 and 1/8 of that, two per
+    // level for blurring
     struct _FBOs {
-        FBO a;
-        FBO b;
+        FBO screen;
+        FBO scene;
+        FBO bloom[BLOOM_LEVELS][2];
     } fbo;
+    int bloomformat;
+
+    // Where the playfield goes in the window. It's square, so it hangs
+    // off the long sides.
+    struct _Viewport {
+        int x;
+        int y;
+        int width;
+        int height;
+    } viewport;
 } RenderState;
 
 typedef struct _RenderParams {
@@ -155,12 +309,126 @@ typedef struct _RenderArgs {
 typedef const RenderState& RS;
 typedef const GameState& GS;
 
+// Driver calls made while drawing, so we can see what batching buys us
+typedef struct _Stats {
+    int calls; // this frame
+    int draws; // this frame
+    size_t bytes; // uploaded this frame
+    int changes; // state changes made this frame
+    int skipped; // and left out, since nothing would have changed
+    int frames;
+} Stats;
+
+const int MAX_TEXTURE_UNITS = 2;
+
+// What GL was last told, so calls that wouldn't change anything can be
+// skipped. Everything that binds, enables or points goes through here.
+typedef struct _GLCache {
+    GLuint program;
+    GLuint buffer; // GL_ARRAY_BUFFER
+    GLuint elements; // GL_ELEMENT_ARRAY_BUFFER, which belongs to the VAO
+    GLuint framebuffer;
+    GLuint vertexarray;
+    int unit; // active texture unit
+    GLuint textures[MAX_TEXTURE_UNITS];
+    GLint viewport[4];
+    bool blend;
+    u32 attribs; // enabled arrays, 1 << A_*
+    struct _Pointer {
+        GLuint buffer;
+        GLint size;
+        GLsizei stride;
+        size_t offset;
+    } pointers[A_LAST];
+    GLuint divisors[A_LAST];
+} GLCache;
+
+// Vertices rewritten every frame. With ARB_buffer_storage the buffer stays
+// mapped and frames take turns at thirds of it, each fenced so we never
+// write what the GPU may still be reading. Otherwise it's orphaned every
+// frame and filled from a copy in memory.
+const int STREAM_FRAMES = 3;
+
+typedef struct _Stream {
+    GLuint handle;
+    int capacity; // vertices per frame
+    bool persistent;
+    StreamVertex* mapped; // all STREAM_FRAMES of it, if persistent
+    GLsync fences[STREAM_FRAMES];
+    int frame; // whose turn it is, if persistent
+    StreamVertex* staging; // otherwise written here, then uploaded
+    int first; // where the next batch starts this frame
+    int count; // vertices in the batch so far
+} Stream;
+
+// Where enemies were hit lately, flashed for a moment
+typedef struct _Spark {
+    float x;
+    float y;
+    float hue;
+    u32 born;
+} Spark;
+
+const int MAX_SPARKS = 64;
+const u32 SPARK_TICKS = 250;
+
+// GPU time of the glow. Queries are read back a few frames late, so
+// we never wait on them.
+const int GPU_QUERIES = 4;
+
+typedef struct _GPUTimer {
+    GLuint queries[GPU_QUERIES];
+    u32 issued;
+    u32 read;
+} GPUTimer;
+
 RenderState _renderstate;
+// Every static mesh, packed into one buffer and its indices into another.
+// Meshes are added while starting up, and the lot is uploaded once
+// they're all in.
+typedef struct _Geometry {
+    float* vertices; // 2 floats each, until uploaded
+    uint16_t* indices; // into all the vertices, until uploaded
+    int nvertices;
+    int size; // indices
+    GLuint handle;
+    GLuint elements;
+} Geometry;
+
+typedef struct _VertexArrays {
+    bool supported;
+    GLuint handles[VA_LAST];
+    bool dirty[VA_LAST]; // pointers need setting up
+} VertexArrays;
+
+Stats _stats;
+GLCache _gl;
+Geometry _geometry;
+VertexArrays _vertexarrays;
+Stream _stream;
+GPUTimer _glowtimer;
+FBOPool _fbos;
+Spark _sparks[MAX_SPARKS];
+int _nextspark;
 RenderParams _params = {
     { 0.01f },
     { 0.0025f }
 };
 
+void on_hit(const GameState& state, const Event& event)
+{
+    Spark spark = { event.pos.x, event.pos.y, event.hue, state.ticks };
+    _sparks[_nextspark++ % MAX_SPARKS] = spark;
+}
+
+// Sparks shrink away to nothing, 0 once they're gone
+float spark_scale(const Spark& spark, u32 ticks)
+{
+    u32 age = ticks - spark.born;
+    if (spark.born == 0 || age >= SPARK_TICKS) return 0;
+    return 0.6f * (1.0f - (float)age / SPARK_TICKS);
+}
+
 // Check for GL errors
 void check_error(const string& message, bool debug=FORCE_DEBUG)
 {
@@ -180,62 +448,376 @@ void check_error(const string& message, bool debug=FORCE_DEBUG)
     }
 }
 
+// Count a state change as made or skipped, true if it needs making
+bool count_change(bool differs)
+{
+    if (differs)
+    {
+        ++_stats.changes;
+        ++_stats.calls;
+    }
+    else
+    {
+        ++_stats.skipped;
+    }
+    return differs;
+}
+
+void bind_program(GLuint program)
+{
+    if (!count_change(_gl.program != program)) return;
+    glUseProgram(program);
+    _gl.program = program;
+}
+
+void bind_buffer(GLuint buffer)
+{
+    if (!count_change(_gl.buffer != buffer)) return;
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    _gl.buffer = buffer;
+}
+
+void bind_elements(GLuint elements)
+{
+    if (!count_change(_gl.elements != elements)) return;
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elements);
+    _gl.elements = elements;
+}
+
+void bind_framebuffer(GLuint framebuffer)
+{
+    if (!count_change(_gl.framebuffer != framebuffer)) return;
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    _gl.framebuffer = framebuffer;
+}
+
+void bind_texture(int unit, GLuint texture)
+{
+    if (!count_change(_gl.textures[unit] != texture)) return;
+    if (_gl.unit != unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        _gl.unit = unit;
+        ++_stats.calls;
+    }
+    glBindTexture(GL_TEXTURE_2D, texture);
+    _gl.textures[unit] = texture;
+}
+
+void set_viewport_rect(GLint x, GLint y, GLint width, GLint height)
+{
+    GLint* v = _gl.viewport;
+    if (!count_change(v[0] != x || v[1] != y || v[2] != width || v[3] != height)) return;
+    glViewport(x, y, width, height);
+    v[0] = x;
+    v[1] = y;
+    v[2] = width;
+    v[3] = height;
+}
+
+void set_blend(bool blend)
+{
+    if (!count_change(_gl.blend != blend)) return;
+    if (blend)
+        glEnable(GL_BLEND);
+    else
+        glDisable(GL_BLEND);
+    _gl.blend = blend;
+}
+
+// Enable exactly the arrays in mask, 1 << A_* each
+void use_attribs(u32 mask)
+{
+    for (int a = 0; a < A_LAST; ++a)
+    {
+        u32 bit = 1 << a;
+        if (!count_change((_gl.attribs & bit) != (mask & bit))) continue;
+        if (mask & bit)
+            glEnableVertexAttribArray(a);
+        else
+            glDisableVertexAttribArray(a);
+    }
+    _gl.attribs = mask;
+}
+
+// Floats from the bound buffer
+void attrib_pointer(int attrib, GLint size, GLsizei stride, size_t offset)
+{
+    GLCache::_Pointer& p = _gl.pointers[attrib];
+    bool same = p.buffer == _gl.buffer && p.size == size && p.stride == stride && p.offset == offset;
+    if (!count_change(!same)) return;
+    glVertexAttribPointer(attrib, size, GL_FLOAT, GL_FALSE, stride, (void*)offset);
+    p.buffer = _gl.buffer;
+    p.size = size;
+    p.stride = stride;
+    p.offset = offset;
+}
+
+void attrib_divisor(int attrib, GLuint divisor)
+{
+    if (!count_change(_gl.divisors[attrib] != divisor)) return;
+    glVertexAttribDivisorARB(attrib, divisor);
+    _gl.divisors[attrib] = divisor;
+}
+
+void bind_vertex_array(GLuint vertexarray)
+{
+    if (!count_change(_gl.vertexarray != vertexarray)) return;
+    glBindVertexArray(vertexarray);
+    _gl.vertexarray = vertexarray;
+}
+
+// A new VAO has every array off, which is what we start tracking from
+void forget_attribs()
+{
+    _gl.elements = 0;
+    _gl.attribs = 0;
+    for (int a = 0; a < A_LAST; ++a)
+    {
+        _gl.pointers[a].size = 0;
+        _gl.divisors[a] = 0;
+    }
+}
+
+// GL unbinds what gets deleted, and may hand the name out again
+void forget_buffer(GLuint buffer)
+{
+    if (_gl.buffer == buffer)
+        _gl.buffer = 0;
+    if (_gl.elements == buffer)
+        _gl.elements = 0;
+    for (int a = 0; a < A_LAST; ++a)
+        if (_gl.pointers[a].buffer == buffer)
+            _gl.pointers[a].size = 0;
+}
+
+void forget_fbo(GLuint framebuffer, GLuint texture)
+{
+    if (_gl.framebuffer == framebuffer)
+        _gl.framebuffer = 0;
+    for (int u = 0; u < MAX_TEXTURE_UNITS; ++u)
+        if (_gl.textures[u] == texture)
+            _gl.textures[u] = 0;
+}
+
+void use_program(const Shader& shader)
+{
+    bind_program(shader.handle);
+}
+
 // Set a uniform shader param
-void set_uniform(GLuint shader, const string& name, float f)
+void set_uniform(const Shader& shader, Uniform name, float f)
 {
-    GLuint loc = glGetUniformLocation(shader, name.c_str());
+    GLint loc = shader.uniforms[name];
+    if (loc < 0) return;
     glUniform1f(loc, f);
+    ++_stats.calls;
 }
-void set_uniform(GLuint shader, const string& name, float x, float y)
+void set_uniform(const Shader& shader, Uniform name, float x, float y)
 {
-    GLuint loc = glGetUniformLocation(shader, name.c_str());
+    GLint loc = shader.uniforms[name];
+    if (loc < 0) return;
     glUniform2f(loc, x, y);
+    ++_stats.calls;
 }
-void set_uniform(GLuint shader, const string& name, const Vec& v)
+void set_uniform(const Shader& shader, Uniform name, const Vec& v)
 {
     set_uniform(shader, name, v.x, v.y);
 }
 
-FBO make_fbo(int width, int height)
+// Point a sampler at a texture unit
+void set_sampler(const Shader& shader, Uniform name, int unit)
+{
+    GLint loc = shader.uniforms[name];
+    if (loc < 0) return;
+    glUniform1i(loc, unit);
+    ++_stats.calls;
+}
+
+size_t fbo_bytes(const FBO& fbo)
+{
+    return fbo.width * fbo.height * (fbo.format == FBO_RGBA16F ? 8 : 4);
+}
+
+// Falls back to RGBA8 if the driver can't render to the format
+FBO make_fbo(int width, int height, int format)
 {
     GLuint fbo;
     GLuint texture;
     glGenFramebuffers(1, &fbo);
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    bind_texture(0, texture);
+    bind_framebuffer(fbo);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_FLOAT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    if (format == FBO_RGBA16F)
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F_ARB, width, height, 0, GL_RGBA, GL_HALF_FLOAT_ARB, NULL);
+    else
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
     check_error("teximage");
     glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
     check_error("framebuftex");
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
     GLuint status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    bind_framebuffer(0);
     if (GL_FRAMEBUFFER_COMPLETE != status)
+    {
+        forget_fbo(fbo, texture);
+        glDeleteFramebuffers(1, &fbo);
+        glDeleteTextures(1, &texture);
+        if (format != FBO_RGBA8)
+            return make_fbo(width, height, FBO_RGBA8);
         cerr << "ERROR Framebuffer is incomplete. Status was " << status << endl;
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        fbo = texture = 0;
+    }
 
     FBO ret;
     ret.handle = fbo;
     ret.texture = texture;
     ret.width = width;
     ret.height = height;
+    ret.format = format;
     return ret;
 
 }
 
+void delete_fbo(const FBO& fbo)
+{
+    forget_fbo(fbo.handle, fbo.texture);
+    glDeleteFramebuffers(1, &fbo.handle);
+    glDeleteTextures(1, &fbo.texture);
+}
+
+// Everything may be handed out again
+void release_fbos()
+{
+    for (int i = 0; i < _fbos.count; ++i)
+        _fbos.used[i] = false;
+}
+
+// Delete whatever wasn't acquired since the last release
+void trim_fbos()
+{
+    FBOPool& pool = _fbos;
+    int kept = 0;
+    for (int i = 0; i < pool.count; ++i)
+    {
+        if (pool.used[i])
+        {
+            pool.fbos[kept] = pool.fbos[i];
+            pool.used[kept++] = true;
+            continue;
+        }
+        delete_fbo(pool.fbos[i]);
+        pool.bytes -= fbo_bytes(pool.fbos[i]);
+        ++pool.deleted;
+    }
+    pool.count = kept;
+}
+
+// A target of this size and format, reused if the pool has a spare one
+FBO acquire_fbo(int width, int height, int format)
+{
+    FBOPool& pool = _fbos;
+    for (int i = 0; i < pool.count; ++i)
+    {
+        const FBO& fbo = pool.fbos[i];
+        if (pool.used[i] || fbo.width != width || fbo.height != height || fbo.format != format)
+            continue;
+        pool.used[i] = true;
+        return fbo;
+    }
+
+    // Make room by dropping the spares early. If every one is in use,
+    // something is acquiring without releasing.
+    if (pool.count == MAX_FBOS)
+        trim_fbos();
+    if (pool.count == MAX_FBOS)
+    {
+        cerr << "ERROR Framebuffer pool is full, all " << MAX_FBOS << " are in use" << endl;
+        abort();
+    }
+
+    FBO fbo = make_fbo(width, height, format);
+    pool.fbos[pool.count] = fbo;
+    pool.used[pool.count++] = true;
+    pool.bytes += fbo_bytes(fbo);
+    pool.peak = max(pool.peak, pool.bytes);
+    ++pool.made;
+    return fbo;
+}
+
+// The pool should hold the glow targets and nothing else, however many
+// times the window has been resized
+bool check_fbo_pool(const RenderState& renderstate)
+{
+    const FBOPool& pool = _fbos;
+    int count = 1 + 2 * BLOOM_LEVELS;
+    size_t bytes = fbo_bytes(renderstate.fbo.scene);
+    for (int l = 0; l < BLOOM_LEVELS; ++l)
+        bytes += fbo_bytes(renderstate.fbo.bloom[l][0]) + fbo_bytes(renderstate.fbo.bloom[l][1]);
+    bool same = pool.count == count && pool.bytes == bytes;
+    if (!same)
+    {
+        logger << "Framebuffer pool holds " << pool.count << " using " << pool.bytes
+               << " bytes, expected " << count << " using " << bytes << endl;
+        bml::warn("Framebuffer pool is holding on to old render targets");
+    }
+    return same;
+}
+
+void make_glow_fbos(int width, int height, bool debug=FORCE_DEBUG)
+{
+    RenderState& renderstate = _renderstate;
+    release_fbos();
+    renderstate.fbo.scene = acquire_fbo(width, height, FBO_RGBA8);
+    for (int l = 0; l < BLOOM_LEVELS; ++l)
+    {
+        int w = max(width >> (l + 1), 1);
+        int h = max(height >> (l + 1), 1);
+        renderstate.fbo.bloom[l][0] = acquire_fbo(w, h, renderstate.bloomformat);
+        // make_fbo fell back, so ask for what we got from now on, or the
+        // pool would never match and we'd remake these on every resize
+        if (renderstate.fbo.bloom[l][0].format != renderstate.bloomformat)
+        {
+            logger << "Can't render to half float, glowing in RGBA8" << endl;
+            renderstate.bloomformat = renderstate.fbo.bloom[l][0].format;
+        }
+        renderstate.fbo.bloom[l][1] = acquire_fbo(w, h, renderstate.bloomformat);
+    }
+    trim_fbos();
+    if (debug)
+        check_fbo_pool(renderstate);
+}
+
+void print_stats()
+{
+    const FBOPool& pool = _fbos;
+    logger << "Framebuffers: " << pool.count << " using " << pool.bytes / 1024 << "KB, peak "
+           << pool.peak / 1024 << "KB (made " << pool.made << ", deleted " << pool.deleted << ")" << endl;
+}
+
 void set_viewport(int x, int y)
 {
     int maxdim = x > y ? x : y;
     int xoffset = min( (x - y) / 2, 0);
     int yoffset = min(-(x - y) / 2, 0);
     cerr << "Setting viewport to " << xoffset << ',' << yoffset << ' ' << maxdim << ',' << maxdim << endl;
-    glViewport(xoffset, yoffset, maxdim, maxdim);
-    _renderstate.fbo.a = make_fbo(maxdim, maxdim);
-    _renderstate.fbo.b = make_fbo(maxdim, maxdim);
+    set_viewport_rect(xoffset, yoffset, maxdim, maxdim);
+    _renderstate.viewport.x = xoffset;
+    _renderstate.viewport.y = yoffset;
+    _renderstate.viewport.width = maxdim;
+    _renderstate.viewport.height = maxdim;
+    _renderstate.fbo.screen.width = x;
+    _renderstate.fbo.screen.height = y;
+    make_glow_fbos(x, y);
+    print_stats();
 }
 
-float* make_polygon_vertex_array(int sides, float innerradius, float outerradius)
+// The flat triangle list polygons used to be drawn from, 4 floats a
+// vertex, kept to check the indexed meshes against
+float* make_polygon_triangles(int sides, float innerradius, float outerradius)
 {
     // 3x4 coordinates per triangle
     float* vertices = new float[sides * 24];
@@ -279,79 +861,482 @@ float* make_polygon_vertex_array(int sides, float innerradius, float outerradius
     return vertices;
 }
 
-// Prepare a triangle array for an N-gon
-float* make_polygon_vertex_array(int sides, float radius)
+// An N-gon as a fan around its middle, or a ring if it has a hole.
+// Outer corners come first, then the inner ones or the middle.
+Mesh make_polygon_mesh(int sides, float inner, float outer)
 {
-    // 3x4 coordinates per triangle
-    float* vertices = new float[sides * 12];
+    bool ring = inner > 0;
+    Mesh ret;
+    ret.nvertices = ring ? 2 * sides : sides + 1;
+    ret.size = (ring ? 6 : 3) * sides;
+    ret.vertices = new float[2 * ret.nvertices];
+    ret.indices = new uint16_t[ret.size];
+
     for (int i = 0; i < sides; ++i)
     {
-
-        int index = i * 12;
         float angle = i * 2 * M_PI / sides;
-        vertices[index  ] = radius * cos(angle);
-        vertices[index+1] = radius * sin(angle);
-        vertices[index+2] = 0;
-        vertices[index+3] = 1;
+        ret.vertices[2 * i] = outer * cos(angle);
+        ret.vertices[2 * i + 1] = outer * sin(angle);
+        if (ring)
+        {
+            ret.vertices[2 * (sides + i)] = inner * cos(angle);
+            ret.vertices[2 * (sides + i) + 1] = inner * sin(angle);
+        }
+    }
+    if (!ring)
+    {
+        ret.vertices[2 * sides] = 0;
+        ret.vertices[2 * sides + 1] = 0;
+    }
 
-        angle = (i+1) * 2 * M_PI / sides;
-        vertices[index+4] = radius * cos(angle);
-        vertices[index+5] = radius * sin(angle);
-        vertices[index+6] = 0;
-        vertices[index+7] = 1;
+    uint16_t* index = ret.indices;
+    for (int i = 0; i < sides; ++i)
+    {
+        int next = (i + 1) % sides;
+        *index++ = i;
+        *index++ = next;
+        *index++ = ring ? sides + next : sides;
+        if (!ring) continue;
+        *index++ = sides + next;
+        *index++ = sides + i;
+        *index++ = i;
+    }
+    return ret;
+}
 
-        vertices[index+8] = 0;
-        vertices[index+9] = 0;
-        vertices[index+10] = 0;
-        vertices[index+11] = 1;
+void delete_mesh(Mesh& mesh)
+{
+    delete[] mesh.vertices;
+    delete[] mesh.indices;
+    mesh.vertices = NULL;
+    mesh.indices = NULL;
+}
+
+// The triangles mesh draws should be the ones the flat list had, less
+// the degenerate ones it padded fans out with
+bool check_polygon_mesh(const Mesh& mesh, int sides, float inner, float outer)
+{
+    const float EPSILON = 1e-6;
+    float* expected = make_polygon_triangles(sides, inner, outer);
+    int t = 0;
+    bool same = true;
+    for (int i = 0; same && i < 2 * sides; ++i)
+    {
+        const float* tri = expected + 12 * i;
+        float area = (tri[4] - tri[0]) * (tri[9] - tri[1]) - (tri[5] - tri[1]) * (tri[8] - tri[0]);
+        if (area == 0) continue;
+        if (3 * t == mesh.size)
+        {
+            same = false;
+            break;
+        }
+        for (int v = 0; v < 3; ++v)
+        {
+            const float* corner = mesh.vertices + 2 * mesh.indices[3 * t + v];
+            same = same && fabs(corner[0] - tri[4 * v]) < EPSILON && fabs(corner[1] - tri[4 * v + 1]) < EPSILON;
+        }
+        ++t;
     }
-    return vertices;
+    same = same && 3 * t == mesh.size;
+    if (!same)
+        bml::warn("Indexed polygon mesh doesn't match its triangle list");
+    delete[] expected;
+    return same;
+}
+
+// Copy count items onto the end of array, which has used of them
+template <typename T>
+void append(T*& array, int used, const T* items, int count)
+{
+    T* grown = new T[used + count];
+    if (used)
+        memcpy(grown, array, used * sizeof(T));
+    memcpy(grown + used, items, count * sizeof(T));
+    delete[] array;
+    array = grown;
 }
 
-GLuint make_vbo(size_t size, float* vertices)
+// Put mesh in the geometry buffer, before it's uploaded
+VBO add_geometry(const Mesh& mesh)
 {
-    GLuint ret;
-    glGenBuffers(1, &ret);
-    glBindBuffer(GL_ARRAY_BUFFER, ret);
-    glBufferData(GL_ARRAY_BUFFER, size, vertices, GL_STATIC_DRAW);
+    Geometry& geometry = _geometry;
+    VBO ret = { geometry.size, mesh.size };
+    if (geometry.nvertices + mesh.nvertices > 65536)
+    {
+        bml::warn("Geometry buffer is out of 16 bit indices");
+        ret.size = 0;
+        return ret;
+    }
+    append(geometry.vertices, 2 * geometry.nvertices, mesh.vertices, 2 * mesh.nvertices);
+    append(geometry.indices, geometry.size, mesh.indices, mesh.size);
+    for (int i = geometry.size; i < geometry.size + mesh.size; ++i)
+        geometry.indices[i] += geometry.nvertices;
+    geometry.nvertices += mesh.nvertices;
+    geometry.size += mesh.size;
+    return ret;
+}
+
+void upload_geometry(bool debug)
+{
+    Geometry& geometry = _geometry;
+    size_t vbytes = 2 * geometry.nvertices * sizeof(float);
+    size_t ibytes = geometry.size * sizeof(uint16_t);
+    glGenBuffers(1, &geometry.handle);
+    bind_buffer(geometry.handle);
+    glBufferData(GL_ARRAY_BUFFER, vbytes, geometry.vertices, GL_STATIC_DRAW);
+    glGenBuffers(1, &geometry.elements);
+    bind_elements(geometry.elements);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, ibytes, geometry.indices, GL_STATIC_DRAW);
     check_error("buffering");
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    if (debug)
+        logger << "Geometry: " << geometry.nvertices << " vertices, " << geometry.size << " indices, "
+               << vbytes + ibytes << " bytes" << endl;
+    delete[] geometry.vertices;
+    delete[] geometry.indices;
+    geometry.vertices = NULL;
+    geometry.indices = NULL;
+}
+
+VBO make_polygon_vbo(int sides, float inner, float radius, bool check)
+{
+    Mesh mesh = make_polygon_mesh(sides, inner, radius);
+    if (check)
+        check_polygon_mesh(mesh, sides, inner, radius);
+    VBO ret = add_geometry(mesh);
+    delete_mesh(mesh);
     return ret;
 }
 
-VBO make_polygon_vbo(int sides, float inner, float radius)
+const int INSTANCE_ATTRIBS[] = { A_OFFSET, A_ROTATION, A_SCALE, A_HUE };
+const int INSTANCE_SIZES[] = { 2, 1, 1, 1 };
+const size_t INSTANCE_OFFSETS[] = {
+    offsetof(Instance, x),
+    offsetof(Instance, rotation),
+    offsetof(Instance, scale),
+    offsetof(Instance, hue)
+};
+
+// Point the arrays at the buffers va reads from
+void point_arrays(int va)
+{
+    switch (va)
+    {
+    case VA_STATIC:
+        bind_buffer(_geometry.handle);
+        bind_elements(_geometry.elements);
+        use_attribs(1 << A_POSITION);
+        attrib_pointer(A_POSITION, 2, 0, 0);
+        break;
+    case VA_INSTANCED:
+        bind_buffer(_renderstate.instances);
+        use_attribs(1 << A_POSITION | 1 << A_OFFSET | 1 << A_ROTATION | 1 << A_SCALE | 1 << A_HUE);
+        for (int i = 0; i < 4; ++i)
+        {
+            attrib_pointer(INSTANCE_ATTRIBS[i], INSTANCE_SIZES[i], sizeof(Instance), INSTANCE_OFFSETS[i]);
+            attrib_divisor(INSTANCE_ATTRIBS[i], 1);
+        }
+        bind_buffer(_geometry.handle);
+        bind_elements(_geometry.elements);
+        attrib_pointer(A_POSITION, 2, 0, 0);
+        break;
+    case VA_STREAM:
+        bind_buffer(_stream.handle);
+        use_attribs(1 << A_POSITION | 1 << A_HUE);
+        attrib_pointer(A_POSITION, 2, sizeof(StreamVertex), 0);
+        attrib_pointer(A_HUE, 1, sizeof(StreamVertex), offsetof(StreamVertex, hue));
+        break;
+    }
+}
+
+void use_vertex_array(int va)
+{
+    VertexArrays& vas = _vertexarrays;
+    if (vas.supported)
+    {
+        bind_vertex_array(vas.handles[va]);
+        if (!vas.dirty[va]) return;
+        // What the cache knows about arrays belongs to whichever VAO was
+        // set up last, so start over from what this one has
+        forget_attribs();
+        vas.dirty[va] = false;
+    }
+    point_arrays(va);
+}
+
+void make_vertex_arrays()
 {
-    VBO ret;
-    int vcount = 6 * sides;
-    size_t memsize = vcount * 4 * sizeof(float);
-    float* vertices = make_polygon_vertex_array(sides, inner, radius);
-    ret.handle = make_vbo(memsize, vertices);
-    delete[] vertices;
-    ret.size = vcount;
+    VertexArrays& vas = _vertexarrays;
+    vas.supported = GLEW_ARB_vertex_array_object;
+    if (!vas.supported)
+    {
+        bml::warn("Vertex array objects unsupported, pointing arrays on every draw instead");
+        return;
+    }
+    glGenVertexArrays(VA_LAST, vas.handles);
+    for (int i = 0; i < VA_LAST; ++i)
+        vas.dirty[i] = true;
+}
+
+void draw_array(VBO vbo)
+{
+    use_vertex_array(VA_STATIC);
+    glDrawElements(GL_TRIANGLES, vbo.size, GL_UNSIGNED_SHORT, (void*)(vbo.first * sizeof(uint16_t)));
+    ++_stats.calls;
+    ++_stats.draws;
+}
+
+// Draw one copy of vbo per instance, with the current program
+void draw_instanced(const RenderState& renderstate, VBO vbo, const Instance* instances, int count)
+{
+    if (count == 0) return;
+
+    // Respecifying the whole buffer orphans last frame's, so we don't stall on it
+    bind_buffer(renderstate.instances);
+    glBufferData(GL_ARRAY_BUFFER, count * sizeof(Instance), instances, GL_STREAM_DRAW);
+
+    use_vertex_array(VA_INSTANCED);
+    glDrawElementsInstancedARB(GL_TRIANGLES, vbo.size, GL_UNSIGNED_SHORT,
+                               (void*)(vbo.first * sizeof(uint16_t)), count);
+    _stats.calls += 2;
+    ++_stats.draws;
+    _stats.bytes += count * sizeof(Instance);
+}
+
+// Make sure the stream has room for this many vertices a frame
+void reserve_stream(int capacity)
+{
+    Stream& stream = _stream;
+    if (capacity <= stream.capacity) return;
+    capacity = max(capacity, 2 * stream.capacity);
+
+    if (stream.handle)
+    {
+        bind_buffer(stream.handle);
+        if (stream.persistent)
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+        forget_buffer(stream.handle);
+        glDeleteBuffers(1, &stream.handle);
+        for (int i = 0; i < STREAM_FRAMES; ++i)
+        {
+            if (stream.fences[i])
+                glDeleteSync(stream.fences[i]);
+            stream.fences[i] = 0;
+        }
+        delete[] stream.staging;
+        stream.staging = NULL;
+        stream.mapped = NULL;
+    }
+
+    stream.capacity = capacity;
+    stream.persistent = GLEW_ARB_buffer_storage && GLEW_ARB_sync;
+    glGenBuffers(1, &stream.handle);
+    bind_buffer(stream.handle);
+    if (stream.persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLsizeiptr size = STREAM_FRAMES * capacity * sizeof(StreamVertex);
+        glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+        stream.mapped = (StreamVertex*)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        check_error("mapping stream");
+    }
+    else
+    {
+        glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(StreamVertex), NULL, GL_STREAM_DRAW);
+        stream.staging = new StreamVertex[capacity];
+    }
+    _vertexarrays.dirty[VA_STREAM] = true;
+}
+
+// Start a frame's worth of batches, totalling at most this many vertices
+void begin_stream(int vertices)
+{
+    Stream& stream = _stream;
+    reserve_stream(vertices);
+    stream.first = stream.count = 0;
+    if (stream.persistent)
+    {
+        // Wait out the frame that last used our third, if the GPU is that far behind
+        stream.frame = (stream.frame + 1) % STREAM_FRAMES;
+        GLsync& fence = stream.fences[stream.frame];
+        if (fence)
+        {
+            glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+            glDeleteSync(fence);
+            fence = 0;
+        }
+    }
+    else
+    {
+        // Orphan last frame's, so we don't stall on it
+        bind_buffer(stream.handle);
+        glBufferData(GL_ARRAY_BUFFER, stream.capacity * sizeof(StreamVertex), NULL, GL_STREAM_DRAW);
+        ++_stats.calls;
+    }
+}
+
+void end_stream()
+{
+    Stream& stream = _stream;
+    if (stream.persistent)
+        stream.fences[stream.frame] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Room for n more vertices in the current batch
+StreamVertex* stream_vertices(int n)
+{
+    Stream& stream = _stream;
+    StreamVertex* base = stream.persistent ? stream.mapped + stream.frame * stream.capacity : stream.staging;
+    StreamVertex* ret = base + stream.first + stream.count;
+    stream.count += n;
     return ret;
 }
 
-void draw_array(VBO vbo, GLenum type = GL_TRIANGLES)
+// Draw the current batch with the current program
+void draw_stream()
 {
-    glBindBuffer(GL_ARRAY_BUFFER, vbo.handle);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 4, GL_FLOAT, GL_FALSE, 0, 0);
-    glDrawArrays(type, 0, vbo.size);
-    glDisableVertexAttribArray(0);
+    Stream& stream = _stream;
+    if (stream.count == 0) return;
+
+    int first = stream.first;
+    if (stream.persistent)
+        first += stream.frame * stream.capacity;
+
+    bind_buffer(stream.handle);
+    if (!stream.persistent)
+    {
+        glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(StreamVertex),
+                        stream.count * sizeof(StreamVertex), stream.staging + first);
+        ++_stats.calls;
+    }
+    use_vertex_array(VA_STREAM);
+    glDrawArrays(GL_TRIANGLES, first, stream.count);
+    ++_stats.calls;
+    ++_stats.draws;
+    _stats.bytes += stream.count * sizeof(StreamVertex);
+
+    stream.first += stream.count;
+    stream.count = 0;
+}
+
+// Put a copy of mesh in the current batch, transformed the way pulse.vs
+// does it, or wiggle.vs if there's any wobble
+void stream_mesh(const Mesh& mesh, const Instance& inst, float pulse, Vec wobble)
+{
+    StreamVertex* out = stream_vertices(mesh.size);
+    float c = cos(inst.rotation);
+    float s = sin(inst.rotation);
+    float k = pulse * inst.scale;
+    for (int v = 0; v < mesh.size; ++v)
+    {
+        const float* corner = mesh.vertices + 2 * mesh.indices[v];
+        float x = corner[0];
+        float y = corner[1];
+        out[v].x = inst.x + (x * c - y * s) * k + (x - y) * wobble.x;
+        out[v].y = inst.y + (x * s + y * c) * k + (x - y) * wobble.y;
+        out[v].hue = inst.hue;
+    }
+}
+
+// Draw a copy of the mesh per instance in one call, with the current program
+void draw_batch(const RenderState& renderstate, VBO vbo, const Mesh& mesh,
+                const Instance* instances, int count, u32 ticks, bool wiggle)
+{
+    if (renderstate.instancing)
+    {
+        draw_instanced(renderstate, vbo, instances, count);
+        return;
+    }
+
+    float phase = ticks * 2 / 1000.0f;
+    float pulse = 1 + 0.02f * sin(phase * π);
+    Vec wobble = { 0, 0 };
+    if (wiggle)
+    {
+        wobble.x = 0.2f * cos(phase * π);
+        wobble.y = 0.2f * sin(phase * π);
+    }
+    for (int i = 0; i < count; ++i)
+        stream_mesh(mesh, instances[i], pulse, wobble);
+    draw_stream();
 }
 
-GLuint make_shader(GLuint vertex, GLuint fragment)
+// Things drawn with the same pair of shaders share a program, so drawing
+// them one after another doesn't switch programs. Whoever draws with a
+// shared one sets every uniform it cares about.
+Shader make_shader(GLuint vertex, GLuint fragment)
 {
-    return arcsynthesis::CreateProgram(vertex, fragment);
+    const int MAX_PROGRAMS = 32;
+    static struct { GLuint vertex, fragment; Shader shader; } programs[MAX_PROGRAMS];
+    static int nprograms = 0;
+    for (int i = 0; i < nprograms; ++i)
+        if (programs[i].vertex == vertex && programs[i].fragment == fragment)
+            return programs[i].shader;
+
+    Shader ret;
+    ret.handle = arcsynthesis::CreateProgram(vertex, fragment);
+    for (int i = 0; i < U_LAST; ++i)
+        ret.uniforms[i] = glGetUniformLocation(ret.handle, UNIFORM_NAMES[i]);
+    if (nprograms < MAX_PROGRAMS)
+    {
+        programs[nprograms].vertex = vertex;
+        programs[nprograms].fragment = fragment;
+        programs[nprograms].shader = ret;
+        ++nprograms;
+    }
+    return ret;
 }
 
+// Draw into fbo, all of it
 void use_framebuffer(const FBO& fbo)
 {
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo.handle);
+    bind_framebuffer(fbo.handle);
+    set_viewport_rect(0, 0, fbo.width, fbo.height);
+    check_error("binding fbo");
+}
+
+// Draw the playfield into fbo, which is the size of the window
+void use_playfield(const RenderState& renderstate, const FBO& fbo)
+{
+    bind_framebuffer(fbo.handle);
+    set_viewport_rect(renderstate.viewport.x, renderstate.viewport.y,
+                      renderstate.viewport.width, renderstate.viewport.height);
     check_error("binding fbo");
 }
 
-void init()
+void begin_gpu_timer(GPUTimer& timer)
+{
+    if (!GLEW_ARB_timer_query) return;
+    if (timer.issued - timer.read == GPU_QUERIES) return; // still waiting on all of them
+    if (timer.issued == 0)
+        glGenQueries(GPU_QUERIES, timer.queries);
+    glBeginQuery(GL_TIME_ELAPSED, timer.queries[timer.issued % GPU_QUERIES]);
+}
+
+void end_gpu_timer(GPUTimer& timer)
+{
+    if (!GLEW_ARB_timer_query) return;
+    if (timer.issued - timer.read == GPU_QUERIES) return;
+    glEndQuery(GL_TIME_ELAPSED);
+    ++timer.issued;
+}
+
+// Hand whatever results are in to the profiler
+void read_gpu_timer(GPUTimer& timer, int phase)
+{
+    while (timer.read != timer.issued)
+    {
+        GLuint query = timer.queries[timer.read % GPU_QUERIES];
+        GLint available = 0;
+        glGetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) return;
+        GLuint64 ns;
+        glGetQueryObjectui64v(query, GL_QUERY_RESULT, &ns);
+        profile::add(phase, ns / 1000.0f);
+        ++timer.read;
+    }
+}
+
+void init(bool debug)
 {
     RenderState& renderstate = _renderstate;
 
@@ -385,10 +1370,18 @@ void init()
                        (GL_FRAGMENT_SHADER, GLSL_VERSION
 #include "circle.fs"
                        );
-    GLuint fs_glow = arcsynthesis::CreateShader
+    GLuint fs_resample = arcsynthesis::CreateShader
+                         (GL_FRAGMENT_SHADER, GLSL_VERSION
+#include "resample.fs"
+                         );
+    GLuint fs_blur = arcsynthesis::CreateShader
                      (GL_FRAGMENT_SHADER, GLSL_VERSION
-#include "glow.fs"
+#include "blur.fs"
                      );
+    GLuint fs_composite = arcsynthesis::CreateShader
+                          (GL_FRAGMENT_SHADER, GLSL_VERSION
+#include "composite.fs"
+                          );
     GLuint fs_fade = arcsynthesis::CreateShader
                      (GL_FRAGMENT_SHADER, GLSL_VERSION
 #include "fade.fs"
@@ -401,24 +1394,76 @@ void init()
                       (GL_FRAGMENT_SHADER, GLSL_VERSION
 #include "meter.fs"
                       );
+    GLuint vs_bar = arcsynthesis::CreateShader
+                    (GL_VERTEX_SHADER, GLSL_VERSION
+#include "bar.vs"
+                    );
+    GLuint fs_bar = arcsynthesis::CreateShader
+                    (GL_FRAGMENT_SHADER, GLSL_VERSION
+#include "bar.fs"
+                    );
+
+    GLuint fs_pulse_instanced = arcsynthesis::CreateShader
+                                (GL_FRAGMENT_SHADER, GLSL_VERSION
+#include "pulse_instanced.fs"
+                                );
+
+    renderstate.instancing = GLEW_ARB_instanced_arrays && GLEW_ARB_draw_instanced;
+    if (renderstate.instancing)
+    {
+        GLuint vs_pulse_instanced = arcsynthesis::CreateShader
+                                    (GL_VERTEX_SHADER, GLSL_VERSION
+#include "pulse_instanced.vs"
+                                    );
+        GLuint vs_wiggle_instanced = arcsynthesis::CreateShader
+                                     (GL_VERTEX_SHADER, GLSL_VERSION
+#include "wiggle_instanced.vs"
+                                     );
+
+        renderstate.shaders.bullet_batch = make_shader(vs_pulse_instanced, fs_scintillate);
+        renderstate.shaders.turd_batch = make_shader(vs_pulse_instanced, fs_scintillate);
+        renderstate.shaders.enemy_batch = make_shader(vs_wiggle_instanced, fs_pulse_instanced);
+        renderstate.shaders.xpchunk_batch = make_shader(vs_pulse_instanced, fs_pulse_instanced);
+        glGenBuffers(1, &renderstate.instances);
+    }
+    else
+    {
+        bml::warn("Instanced arrays unsupported, streaming transformed entities instead");
+        GLuint vs_stream = arcsynthesis::CreateShader
+                           (GL_VERTEX_SHADER, GLSL_VERSION
+#include "stream.vs"
+                           );
+
+        renderstate.shaders.bullet_batch = make_shader(vs_stream, fs_scintillate);
+        renderstate.shaders.turd_batch = make_shader(vs_stream, fs_scintillate);
+        renderstate.shaders.enemy_batch = make_shader(vs_stream, fs_pulse_instanced);
+        renderstate.shaders.xpchunk_batch = make_shader(vs_stream, fs_pulse_instanced);
+    }
+
 
 
+    // Static meshes, all in one buffer
+    renderstate.vbo.player = make_polygon_vbo(3, 0.0, 0.5, debug);
+    renderstate.vbo.square = make_polygon_vbo(4, 0.0, 0.5 * ROOT_2, debug);
+    renderstate.vbo.nova = make_polygon_vbo(3, 0.48, 0.5, debug);
+    renderstate.vbo.reticle = make_polygon_vbo(5, 0.09, 0.12, debug);
+    renderstate.vbo.enemy = make_polygon_vbo(6, 0.03, 0.09, debug);
+    renderstate.mesh.player = make_polygon_mesh(3, 0.0, 0.5);
+    renderstate.mesh.enemy = make_polygon_mesh(6, 0.03, 0.09);
 
-    // Set up VBO
-    renderstate.vbo.player = make_polygon_vbo(3, 0.0, 0.5);
-    renderstate.vbo.square = make_polygon_vbo(4, 0.0, 0.5 * ROOT_2);
-    renderstate.vbo.nova = make_polygon_vbo(3, 0.48, 0.5);
-    renderstate.vbo.reticle = make_polygon_vbo(5, 0.09, 0.12);
-    renderstate.vbo.enemy = make_polygon_vbo(6, 0.03, 0.09);
+    // One triangle covers the viewport, with the corners it doesn't need clipped
+    float fullscreenVertices[] = { -1, -1, 3, -1, -1, 3 };
+    uint16_t fullscreenIndices[] = { 0, 1, 2 };
+    Mesh fullscreen = { fullscreenVertices, fullscreenIndices, 3, 3 };
+    renderstate.vbo.fullscreen = add_geometry(fullscreen);
 
-    VertexBuffer<4> viewportVertices = {
-        -1, 1, 0, 1,
-        -1, -1, 0, 1,
-        1, -1, 0, 1,
-        1,  1, 0, 1,
-    };
-    renderstate.vbo.viewport.handle = make_vbo(sizeof(viewportVertices), viewportVertices.flat);
-    renderstate.vbo.viewport.size = 4;
+    // Bars get stretched out of this, so they need all of it
+    float quadVertices[] = { -1, -1, 1, -1, 1, 1, -1, 1 };
+    uint16_t quadIndices[] = { 0, 1, 2, 0, 2, 3 };
+    Mesh quad = { quadVertices, quadIndices, 4, 6 };
+    renderstate.vbo.quad = add_geometry(quad);
+    upload_geometry(debug);
+    make_vertex_arrays();
 
     // Init shaders
     renderstate.shaders.player = make_shader(vs_pulse, fs_scintillate);
@@ -430,26 +1475,49 @@ void init()
     renderstate.shaders.turd = make_shader(vs_pulse, fs_scintillate);
     renderstate.shaders.nova = make_shader(vs_pulse, fs_circle);
     renderstate.shaders.xpchunk = make_shader(vs_pulse, fs_pulse);
-    renderstate.shaders.post_blur = make_shader(vs_noop, fs_glow);
+    renderstate.shaders.bloom_resample = make_shader(vs_noop, fs_resample);
+    renderstate.shaders.bloom_blur = make_shader(vs_noop, fs_blur);
+    renderstate.shaders.bloom_composite = make_shader(vs_noop, fs_composite);
     renderstate.shaders.viewport = make_shader(vs_noop, fs_swirl);
-
-    // Framebuffers
-    renderstate.fbo.a = make_fbo(400, 400);
-    renderstate.fbo.b = make_fbo(400, 400);
+    renderstate.shaders.profile = make_shader(vs_bar, fs_bar);
+
+    // Framebuffers, to fit whatever viewport the window started with
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    renderstate.viewport.x = viewport[0];
+    renderstate.viewport.y = viewport[1];
+    renderstate.viewport.width = viewport[2];
+    renderstate.viewport.height = viewport[3];
+    for (int i = 0; i < 4; ++i)
+        _gl.viewport[i] = viewport[i];
+    renderstate.fbo.screen.width = viewport[2];
+    renderstate.fbo.screen.height = viewport[3];
+    renderstate.bloomformat = GLEW_ARB_texture_float && GLEW_ARB_half_float_pixel ? FBO_RGBA16F : FBO_RGBA8;
+    make_glow_fbos(viewport[2], viewport[3], debug);
 
     // Misc setup
     glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
     check_error("clearcolor");
 
+    events::subscribe(1 << Event::T_ENT_HIT, on_hit);
+
 }
 
 void draw_background(const RenderArgs& args)
 {
-    GLuint shader = args.rs.shaders.viewport;
-    VBO vbo = args.rs.vbo.viewport;
-    glUseProgram(shader);
-    set_uniform(shader, "ticks", args.ticks);
-    draw_array(vbo, GL_QUADS);
+    Shader shader = args.rs.shaders.viewport;
+    use_program(shader);
+    set_uniform(shader, U_TICKS, args.ticks);
+    draw_array(args.rs.vbo.fullscreen);
+}
+
+// Brightness of the player, which dims on the beat
+float player_value(GS state)
+{
+    float checkpoint = fabs(state.player.phase - 0.5) * 12;
+    if (checkpoint < 1.0)
+        return checkpoint;
+    return 1;
 }
 
 void draw_triangle(const RenderArgs& args)
@@ -457,17 +1525,14 @@ void draw_triangle(const RenderArgs& args)
     RS renderstate = args.rs;
     GS state = args.gs;
 
-    GLuint shader = renderstate.shaders.player;
-    glUseProgram(shader);
-    set_uniform(shader, "offset", state.player.pos);
-    set_uniform(shader, "rotation", state.player.rotation);
-    set_uniform(shader, "ticks", args.ticks);
-    set_uniform(shader, "phase", state.player.phase);
-    set_uniform(shader, "value", 1);
-    float checkpoint = fabs(state.player.phase - 0.5) * 12;
-    if (checkpoint < 1.0)
-        set_uniform(shader, "value", checkpoint);
-    set_uniform(shader, "scale", state.player.size);
+    Shader shader = renderstate.shaders.player;
+    use_program(shader);
+    set_uniform(shader, U_OFFSET, state.player.pos);
+    set_uniform(shader, U_ROTATION, state.player.rotation);
+    set_uniform(shader, U_TICKS, args.ticks);
+    set_uniform(shader, U_PHASE, state.player.phase);
+    set_uniform(shader, U_VALUE, player_value(state));
+    set_uniform(shader, U_SCALE, state.player.size);
     draw_array(renderstate.vbo.player);
 
 }
@@ -477,13 +1542,14 @@ void draw_square(const RenderArgs& args)
     RS renderstate = args.rs;
     GS state = args.gs;
 
-    GLuint shader = renderstate.shaders.square;
-    glUseProgram(shader);
-    set_uniform(shader, "offset", state.square.pos);
-    set_uniform(shader, "rotation", π / 4);
-    set_uniform(shader, "ticks", args.ticks);
-    set_uniform(shader, "phase", 0.5 + state.player.phase);
-    set_uniform(shader, "scale", state.square.size);
+    Shader shader = renderstate.shaders.square;
+    use_program(shader);
+    set_uniform(shader, U_OFFSET, state.square.pos);
+    set_uniform(shader, U_ROTATION, π / 4);
+    set_uniform(shader, U_TICKS, args.ticks);
+    set_uniform(shader, U_PHASE, 0.5 + state.player.phase);
+    set_uniform(shader, U_VALUE, 1);
+    set_uniform(shader, U_SCALE, state.square.size);
     draw_array(renderstate.vbo.square);
 }
 
@@ -493,109 +1559,149 @@ void draw_reticle(const RenderArgs& args)
     GS state = args.gs;
     u32 ticks = args.ticks;
 
-    GLuint shader = renderstate.shaders.reticle;
-    glUseProgram(shader);
-    set_uniform(shader, "offset", state.player.reticle);
-    set_uniform(shader, "rotation", ticks / 1000.0f);
-    set_uniform(shader, "phase", 0.02 + state.player.phase);
-    set_uniform(shader, "ticks", ticks);
-    set_uniform(shader, "scale", 1.05);
-    set_uniform(shader, "value", 0);
+    Shader shader = renderstate.shaders.reticle;
+    use_program(shader);
+    set_uniform(shader, U_OFFSET, state.player.reticle);
+    set_uniform(shader, U_ROTATION, ticks / 1000.0f);
+    set_uniform(shader, U_PHASE, 0.02 + state.player.phase);
+    set_uniform(shader, U_TICKS, ticks);
+    set_uniform(shader, U_SCALE, 1.05);
+    set_uniform(shader, U_VALUE, 0);
     draw_array(renderstate.vbo.reticle);
-    set_uniform(shader, "scale", 1);
-    set_uniform(shader, "value", 1);
+    set_uniform(shader, U_SCALE, 1);
+    set_uniform(shader, U_VALUE, 1);
     float checkpoint = fabs(state.player.phase - 0.5) * 20;
     if (checkpoint < 1.0)
-        set_uniform(shader, "value", checkpoint);
+        set_uniform(shader, U_VALUE, checkpoint);
     draw_array(renderstate.vbo.reticle);
 }
 
 void draw_life_meter(const RenderArgs& args)
 {
-    GLuint shader = args.rs.shaders.meter;
-    glUseProgram(shader);
-    set_uniform(shader, "percent", args.gs.player.life);
-    set_uniform(shader, "ticks", args.ticks);
-    draw_array(args.rs.vbo.viewport, GL_QUADS);
+    Shader shader = args.rs.shaders.meter;
+    use_program(shader);
+    set_uniform(shader, U_PERCENT, args.gs.player.life);
+    set_uniform(shader, U_TICKS, args.ticks);
+    draw_array(args.rs.vbo.quad);
 }
 
+// Novae need their center and radius per fragment, so they don't batch
+void draw_novae(const RenderArgs& args)
+{
+    RS renderstate = args.rs;
+    const Entities& ents = args.gs.entities;
+
+    Shader shader = renderstate.shaders.nova;
+    use_program(shader);
+    for (int k = 0; k < ents.count[E_NOVA]; ++k)
+    {
+        int i = ents.live[E_NOVA][k];
+        set_uniform(shader, U_SCALE, (100 - 100*ents.life[i]));
+        set_uniform(shader, U_OFFSET, ents.x[i], ents.y[i]);
+        set_uniform(shader, U_ROTATION, ents.rotation[i]);
+        set_uniform(shader, U_CENTER, ents.x[i], ents.y[i]);
+        set_uniform(shader, U_TICKS, 0); // HACK
+        set_uniform(shader, U_RADIUS, (100 - 100*ents.life[i]));
+        draw_array(renderstate.vbo.nova);
+    }
+}
+
+// Draw bullets, enemies and turds with one call per type
 void draw_entities(const RenderArgs& args)
 {
     RS renderstate = args.rs;
     GS state = args.gs;
     u32 ticks = args.ticks;
+    const Entities& ents = state.entities;
+    static Instance* instances = NULL;
+    static int capacity = 0;
+    if (capacity < ents.capacity + MAX_SPARKS)
+    {
+        delete[] instances;
+        capacity = ents.capacity + MAX_SPARKS;
+        instances = new Instance[capacity];
+    }
+    Shader shader;
+    int n;
 
-    for (int i = 0; i < MAX_ENTITIES; ++i)
+    if (!renderstate.instancing)
     {
-        const Entity& e = state.entities[i];
-        if (e.life <= 0) continue;
+        int small = ents.count[E_ROCKET] + ents.count[E_BULLET] + ents.count[E_TURD];
+        int big = ents.count[E_XPCHUNK] + MAX_SPARKS + ents.count[E_ENEMY];
+        begin_stream(small * renderstate.mesh.player.size + big * renderstate.mesh.enemy.size);
+    }
 
-        if (e.type == E_ROCKET)
-        {
-            GLuint shader = renderstate.shaders.player;
-            glUseProgram(shader);
-            set_uniform(shader, "offset", e.pos);
-            set_uniform(shader, "rotation", e.rotation);
-            set_uniform(shader, "ticks", ticks);
-            set_uniform(shader, "scale", state.player.size);
-            draw_array(renderstate.vbo.player);
-        }
-        if (e.type == E_BULLET)
-        {
-            GLuint shader = renderstate.shaders.player;
-            glUseProgram(shader);
-            set_uniform(shader, "offset", e.pos);
-            set_uniform(shader, "ticks", ticks);
-            set_uniform(shader, "rotation", ticks / 100.0f);
-            set_uniform(shader, "scale", state.player.size * 0.1);
-            draw_array(renderstate.vbo.player);
-        }
-        if (e.type == E_TURD)
-        {
-            GLuint shader = renderstate.shaders.turd;
-            glUseProgram(shader);
-            set_uniform(shader, "offset", e.pos);
-            set_uniform(shader, "scale", 0.04 + 0.01 * (1.0 - e.life));
-            set_uniform(shader, "rotation", e.rotation);
-            set_uniform(shader, "ticks", ticks);
-            set_uniform(shader, "phase", 0.5 - state.player.phase);
-            draw_array(renderstate.vbo.player);
-        }
-        if (e.type == E_NOVA)
-        {
-            GLuint shader = renderstate.shaders.nova;
-            glUseProgram(shader);
-            set_uniform(shader, "scale", (100 - 100*e.life));
-            set_uniform(shader, "offset", e.pos);
-            set_uniform(shader, "rotation", e.rotation);
-            set_uniform(shader, "center", e.pos);
-            set_uniform(shader, "ticks", 0); // HACK
-            set_uniform(shader, "radius", (100 - 100*e.life));
-            draw_array(renderstate.vbo.nova);
-        }
-        if (e.type == E_XPCHUNK)
-        {
-            GLuint shader = renderstate.shaders.xpchunk;
-            glUseProgram(shader);
-            set_uniform(shader, "offset", e.pos);
-            set_uniform(shader, "rotation", 0.0);
-            set_uniform(shader, "scale", 0.3);
-            set_uniform(shader, "ticks", ticks);
-            set_uniform(shader, "hue", e.hue);
-            draw_array(renderstate.vbo.enemy);
-        }
-        if (e.type == E_ENEMY)
-        {
-            GLuint shader = renderstate.shaders.enemy;
-            glUseProgram(shader);
-            set_uniform(shader, "offset", e.pos);
-            set_uniform(shader, "rotation", ticks / 400.0f);
-            set_uniform(shader, "scale", 0.9);
-            set_uniform(shader, "ticks", ticks);
-            set_uniform(shader, "hue", e.hue);
-            draw_array(renderstate.vbo.enemy);
-        }
+    // Rockets and bullets share a shader and mesh, so they go in one batch
+    shader = renderstate.shaders.bullet_batch;
+    use_program(shader);
+    n = 0;
+    for (int k = 0; k < ents.count[E_ROCKET]; ++k)
+    {
+        int i = ents.live[E_ROCKET][k];
+        Instance inst = { ents.x[i], ents.y[i], ents.rotation[i], state.player.size, 0 };
+        instances[n++] = inst;
+    }
+    for (int k = 0; k < ents.count[E_BULLET]; ++k)
+    {
+        int i = ents.live[E_BULLET][k];
+        Instance inst = { ents.x[i], ents.y[i], ticks / 100.0f, state.player.size * 0.1f, 0 };
+        instances[n++] = inst;
+    }
+    set_uniform(shader, U_TICKS, ticks);
+    set_uniform(shader, U_PHASE, state.player.phase);
+    set_uniform(shader, U_VALUE, player_value(state));
+    draw_batch(renderstate, renderstate.vbo.player, renderstate.mesh.player, instances, n, ticks, false);
+
+    shader = renderstate.shaders.turd_batch;
+    use_program(shader);
+    n = 0;
+    for (int k = 0; k < ents.count[E_TURD]; ++k)
+    {
+        int i = ents.live[E_TURD][k];
+        Instance inst = { ents.x[i], ents.y[i], ents.rotation[i], 0.04f + 0.01f * (1.0f - ents.life[i]), 0 };
+        instances[n++] = inst;
+    }
+    set_uniform(shader, U_TICKS, ticks);
+    set_uniform(shader, U_PHASE, 0.5 - state.player.phase);
+    set_uniform(shader, U_VALUE, 1);
+    draw_batch(renderstate, renderstate.vbo.player, renderstate.mesh.player, instances, n, ticks, false);
+
+    draw_novae(args);
+
+    shader = renderstate.shaders.xpchunk_batch;
+    use_program(shader);
+    n = 0;
+    for (int k = 0; k < ents.count[E_XPCHUNK]; ++k)
+    {
+        int i = ents.live[E_XPCHUNK][k];
+        Instance inst = { ents.x[i], ents.y[i], 0, 0.3f, ents.hue[i] };
+        instances[n++] = inst;
+    }
+    // Sparks look like chunks, so they ride along
+    for (int i = 0; i < MAX_SPARKS; ++i)
+    {
+        float scale = spark_scale(_sparks[i], ticks);
+        if (scale == 0) continue;
+        Instance inst = { _sparks[i].x, _sparks[i].y, 0, scale, _sparks[i].hue };
+        instances[n++] = inst;
+    }
+    set_uniform(shader, U_TICKS, ticks);
+    draw_batch(renderstate, renderstate.vbo.enemy, renderstate.mesh.enemy, instances, n, ticks, false);
+
+    shader = renderstate.shaders.enemy_batch;
+    use_program(shader);
+    n = 0;
+    for (int k = 0; k < ents.count[E_ENEMY]; ++k)
+    {
+        int i = ents.live[E_ENEMY][k];
+        Instance inst = { ents.x[i], ents.y[i], ticks / 400.0f, 0.9f, ents.hue[i] };
+        instances[n++] = inst;
     }
+    set_uniform(shader, U_TICKS, ticks);
+    draw_batch(renderstate, renderstate.vbo.enemy, renderstate.mesh.enemy, instances, n, ticks, true);
+
+    if (!renderstate.instancing)
+        end_stream();
 }
 
 void draw_glowy_things(const RenderArgs& args)
@@ -608,42 +1714,136 @@ void draw_glowy_things(const RenderArgs& args)
 
 }
 
-void apply_two_pass_glow(const RenderState& renderstate)
+// Blur the scene at a few resolutions and draw it to the screen with the
+// blur added on top
+void apply_bloom(const RenderState& renderstate, int quality)
 {
-    glUseProgram(renderstate.shaders.post_blur);
-    glBindTexture(GL_TEXTURE_2D, renderstate.fbo.a.texture);
-    use_framebuffer(renderstate.fbo.b);
+    const FBO (&bloom)[BLOOM_LEVELS][2] = renderstate.fbo.bloom;
+    VBO quad = renderstate.vbo.fullscreen;
+    int first = quality == GLOW_LOW ? 1 : 0;
+    int last = quality == GLOW_HIGH ? 2 : 1;
+
+    // Shrink the scene down the chain
+    Shader shader = renderstate.shaders.bloom_resample;
+    use_program(shader);
+    set_sampler(shader, U_TEXSOURCE, 0);
+    set_uniform(shader, U_RADIUS, 1);
+    const FBO* source = &renderstate.fbo.scene;
+    for (int l = first; l <= last; ++l)
+    {
+        use_framebuffer(bloom[l][0]);
+        bind_texture(0, source->texture);
+        set_uniform(shader, U_TEXTURESIZE, source->width, source->height);
+        draw_array(quad);
+        source = &bloom[l][0];
+    }
+
+    // Blur each level across into its partner, then down back into it
+    shader = renderstate.shaders.bloom_blur;
+    use_program(shader);
+    set_sampler(shader, U_TEXSOURCE, 0);
     Vec uX = {1, 0};
-    set_uniform(renderstate.shaders.post_blur, "texSource", renderstate.fbo.a.texture);
-    check_error("setting texture uniform 2");
-    set_uniform(renderstate.shaders.post_blur, "dir", uX);
-    set_uniform(renderstate.shaders.post_blur, "textureSize", renderstate.fbo.a.width);
-    draw_array(renderstate.vbo.viewport, GL_QUADS);
-
-    glBindTexture(GL_TEXTURE_2D, renderstate.fbo.b.texture);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
     Vec uY = {0, 1};
-    set_uniform(renderstate.shaders.post_blur, "texSource", renderstate.fbo.b.texture);
-    check_error("setting texture uniform 3");
-    set_uniform(renderstate.shaders.post_blur, "dir", uY);
-    set_uniform(renderstate.shaders.post_blur, "textureSize", renderstate.fbo.a.height);
-    draw_array(renderstate.vbo.viewport, GL_QUADS);
-    glUseProgram(0);
+    for (int l = first; l <= last; ++l)
+    {
+        set_uniform(shader, U_TEXTURESIZE, bloom[l][0].width, bloom[l][0].height);
+        use_framebuffer(bloom[l][1]);
+        bind_texture(0, bloom[l][0].texture);
+        set_uniform(shader, U_DIR, uX);
+        draw_array(quad);
+        use_framebuffer(bloom[l][0]);
+        bind_texture(0, bloom[l][1].texture);
+        set_uniform(shader, U_DIR, uY);
+        draw_array(quad);
+    }
+
+    // Add each level into the one above it, so the widest glow ends up on top
+    shader = renderstate.shaders.bloom_resample;
+    use_program(shader);
+    set_uniform(shader, U_RADIUS, 0.5);
+    set_blend(true);
+    glBlendFunc(GL_ONE, GL_ONE);
+    for (int l = last; l > first; --l)
+    {
+        use_framebuffer(bloom[l - 1][0]);
+        bind_texture(0, bloom[l][0].texture);
+        set_uniform(shader, U_TEXTURESIZE, bloom[l][0].width, bloom[l][0].height);
+        draw_array(quad);
+    }
+    set_blend(false);
+
+    // Once to the whole window, scene and glow together
+    shader = renderstate.shaders.bloom_composite;
+    use_program(shader);
+    use_framebuffer(renderstate.fbo.screen);
+    bind_texture(1, bloom[first][0].texture);
+    bind_texture(0, renderstate.fbo.scene.texture);
+    set_sampler(shader, U_TEXSOURCE, 0);
+    set_sampler(shader, U_TEXBLOOM, 1);
+    set_uniform(shader, U_VALUE, BLOOM_STRENGTH);
+    draw_array(quad);
+}
 
+// Frame timings as bars down the left, one row per phase. The bright
+// bar is the median, the dimmer ones behind it p95 and p99. The red
+// line is the frame budget.
+void draw_profile(const RenderArgs& args)
+{
+    const float BUDGET = 20000; // microseconds at 50fps
+    const float WIDTH = 1.0; // of a budget's worth of bar
+    const float LEFT = -0.95;
+    const float TOP = 0.95;
+    const float ROW = 0.04;
+
+    Shader shader = args.rs.shaders.profile;
+    use_program(shader);
+    for (int p = 0; p < P_LAST; ++p)
+    {
+        PhaseStats s = profile::stats(p);
+        float widths[] = { s.p99, s.p95, s.p50 };
+        float values[] = { 0.3, 0.6, 1.0 };
+        Vec offset = { LEFT, TOP - (p + 1) * ROW };
+        set_uniform(shader, U_OFFSET, offset);
+        set_uniform(shader, U_HUE, (p + 1.0f) / (P_LAST + 1));
+        for (int i = 0; i < 3; ++i)
+        {
+            Vec size = { min(widths[i] / BUDGET * WIDTH, 1.9f), ROW * 0.8f };
+            set_uniform(shader, U_SIZE, size);
+            set_uniform(shader, U_VALUE, values[i]);
+            draw_array(args.rs.vbo.quad);
+        }
+    }
+
+    Vec offset = { LEFT + WIDTH, TOP - P_LAST * ROW };
+    Vec size = { 0.005, P_LAST * ROW };
+    set_uniform(shader, U_OFFSET, offset);
+    set_uniform(shader, U_SIZE, size);
+    set_uniform(shader, U_HUE, 0);
+    set_uniform(shader, U_VALUE, 1);
+    draw_array(args.rs.vbo.quad);
 }
 
 // Render a frame
 void render(GameState& state, u32 ticks, bool debug, const Input& input)
 {
     RenderArgs args = { _params, state, _renderstate, ticks, debug };
-
-    static bool glow = false;
-    glow ^= input.sys.glowtoggle;
+    _stats.calls = 0;
+    _stats.draws = 0;
+    _stats.bytes = 0;
+    _stats.changes = 0;
+    _stats.skipped = 0;
+
+    static int glow = GLOW_OFF;
+    if (input.sys.glowtoggle)
+    {
+        glow = (glow + 1) % GLOW_LAST;
+        logger << "Glow: " << GLOW_NAMES[glow] << endl;
+    }
 
     // Clear
     if (glow)
     { 
-        use_framebuffer(args.rs.fbo.a);
+        use_playfield(args.rs, args.rs.fbo.scene);
     }
 
     glClear(GL_COLOR_BUFFER_BIT);
@@ -654,16 +1854,27 @@ void render(GameState& state, u32 ticks, bool debug, const Input& input)
     // Render gameplay
     draw_glowy_things(args);
 
-    // Glow filter to screen; Render gameplay again
+    // Glow filter to screen
     if (glow) 
     {
-        apply_two_pass_glow(args.rs);
-        draw_glowy_things(args);
+        Profile scope(P_GLOW);
+        begin_gpu_timer(_glowtimer);
+        apply_bloom(args.rs, glow);
+        end_gpu_timer(_glowtimer);
+        use_playfield(args.rs, args.rs.fbo.screen);
     }
+    read_gpu_timer(_glowtimer, P_GLOW_GPU);
 
     // Render bullets, enemies and turds
     draw_entities(args);
 
+    if (debug)
+        draw_profile(args);
+
+    if (debug && ++_stats.frames % 250 == 0)
+        logger << "GL calls this frame: " << _stats.calls << ", " << _stats.draws << " draws, "
+               << _stats.bytes << " bytes uploaded, " << _stats.changes << " state changes made and "
+               << _stats.skipped << " skipped" << endl;
 }
 
 } // namespace gfx
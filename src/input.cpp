@@ -185,4 +185,27 @@ Input handle_input()
     return ret;
 }
 
+// Make up some plausible input for running without a player: circle the
+// reticle, wander around, keep shooting and drop the odd turd and nova
+Input synthesize(u32 frame)
+{
+    Input ret = {0};
+
+    float t = frame / 50.0f;
+    ret.axes.x2 = 0.8 * cos(t);
+    ret.axes.y2 = 0.8 * sin(t);
+    ret.axes.x1 = sin(t / 3);
+    ret.axes.y1 = cos(t / 5);
+    ret.axes.x4 = sin(t / 7);
+    ret.axes.y4 = cos(t / 11);
+
+    ret.shoot = true;
+    ret.poop = (frame % 10 == 0);
+    ret.auxshoot = (frame % 50 == 0);
+    ret.auxpoop = (frame % 250 == 0);
+    ret.attract = (frame % 500 < 100);
+    ret.respawn = true;
+    return ret;
+}
+
 } // namespace input
@@ -1,5 +1,8 @@
 #include <iostream>
 #include <ctime>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
 #include "GL/glew.h"
 #include "crossgl.h"
 #include "SDL.h"
@@ -17,6 +20,12 @@ typedef struct _Args {
     bool fullscreen;
     bool windowed;
     bool mute;
+    bool headless;
+    int frames; // how long to run headless
+    const char* record; // file to record the session to
+    const char* replay; // file to play back, headless
+    const char* profile; // where to write frame timings on exit, with -d
+    const char* audio; // render the headless run's audio to this WAV
 } Args;
 
 // Commandline arguments
@@ -26,8 +35,18 @@ Args args;
 bool fullscreen = false;
 SDL_Window* win;
 
-// Gameplay
+// Gameplay runs in fixed steps, however fast we can draw
+const u32 FPS = 50; // steps per second
+const u32 STEP = 1000 / FPS; // millis
+const double MAX_LAG = 250; // millis we'll catch up on before the game slows down instead
 GameState state = {0};
+Snapshot previous = {0}; // a step ago, to draw in between
+Snapshot current = {0}; // the latest step, while drawing in between
+u32 seed;
+Uint64 lastframe; // performance counter
+double lag = 0; // millis not simulated yet
+Input pending = {0}; // input no step has seen yet
+bool vsync = false;
 SDL_GLContext context = {0};
 
 // Forward
@@ -41,7 +60,44 @@ int parse_args(int argc, char** argv, Args* outArgs)
     {
         char* arg = argv[i];
         char first = arg[0];
-        if (first == '-')
+        if (first == '-' && arg[1] == '-')
+        {
+            if (!strcmp(arg, "--headless"))
+                outArgs->headless = true;
+            if (!strcmp(arg, "--frames") && i + 1 < argc)
+                outArgs->frames = atoi(argv[++i]);
+            if (!strcmp(arg, "--record") && i + 1 < argc)
+                outArgs->record = argv[++i];
+            if (!strcmp(arg, "--replay") && i + 1 < argc)
+            {
+                outArgs->replay = argv[++i];
+                outArgs->headless = true;
+            }
+            if (!strcmp(arg, "--profile") && i + 1 < argc)
+                outArgs->profile = argv[++i];
+            if (!strcmp(arg, "--audio") && i + 1 < argc)
+                outArgs->audio = argv[++i];
+            // Params are applied in order, so --set can override a --config
+            if (!strcmp(arg, "--config") && i + 1 < argc)
+            {
+                if (!game::load_params(argv[++i]))
+                    return 1;
+            }
+            if (!strcmp(arg, "--set") && i + 1 < argc)
+            {
+                char* name = argv[++i];
+                char* value = strchr(name, '=');
+                if (!value)
+                {
+                    fprintf(stderr, "--set wants name=value, got %s\n", name);
+                    return 1;
+                }
+                *value++ = '\0';
+                if (!game::set_param(name, value))
+                    return 1;
+            }
+        }
+        else if (first == '-')
         {
             if (arg[1] == 'd')
                 outArgs->debug = true;
@@ -57,6 +113,25 @@ int parse_args(int argc, char** argv, Args* outArgs)
     return 0;
 }
 
+// Fold a frame's input into what the next step sees. Held buttons and
+// axes are whatever they are now; presses and mouse motion add up until
+// a step has used them, so none are lost on frames that don't step.
+void merge_input(Input& into, const Input& input)
+{
+    Input merged = input;
+    merged.axes.x3 += into.axes.x3;
+    merged.axes.y3 += into.axes.y3;
+    merged.auxshoot |= into.auxshoot;
+    merged.auxpoop |= into.auxpoop;
+    into = merged;
+}
+
+void consume_input(Input& input)
+{
+    input.axes.x3 = input.axes.y3 = 0;
+    input.auxshoot = input.auxpoop = false;
+}
+
 int enter_fullscreen()
 {
 #if USE_EMSCRIPTEN
@@ -104,39 +179,127 @@ void print_info()
 
 void loop()
 {
-    game::init(state);
-    gfx::init();
-    audio::init(SDL_GetTicks());
+    game::init(state, seed);
+    state.ticks = SDL_GetTicks();
+    game::snapshot(previous, state);
+    lastframe = SDL_GetPerformanceCounter();
+    if (args.record)
+        replay::record(args.record, seed, state.ticks);
+    gfx::init(args.debug);
+    audio::init(SDL_GetTicks(), args.debug);
     input::init();
 
     SDL_ShowCursor(SDL_DISABLE);
 
     if (args.mute)
     {
-        SDL_PauseAudio(1); // HACK TODO volume control
+        audio::mute(); // HACK TODO volume control
     }
 
-    u32 FPS = 50;
 #if __EMSCRIPTEN__
-    emscripten_set_main_loop(_update, FPS, false);
+    emscripten_set_main_loop(_update, 0, false); // as often as the browser paints
     return;
 #endif
 
-    // TODO un-hard-code FPS and BPM
+    // TODO un-hard-code BPM
     while (!state.over)
     {
-
         u32 ticks = SDL_GetTicks();
         _update();
 
-        // Finish frame
-        u32 next = ticks + 1000 / FPS;
+        // Swapping waits for the display if vsync is on, otherwise we
+        // don't draw faster than we step
+        if (vsync) continue;
+        u32 next = ticks + STEP;
         u32 now = SDL_GetTicks();
         if (next > now)
             SDL_Delay(next - now);
     }
 }
 
+// Run the simulation alone, no window, GL or audio, as fast as it will go.
+// Input is made up, or comes from a recording whose hashes we check as we go.
+int headless()
+{
+    // The clock starts wherever the recording's did, since it's hashed
+    u32 startticks = 0;
+    if (args.replay && !replay::play(args.replay, seed, startticks))
+        return 1;
+    game::init(state, seed);
+    state.ticks = startticks;
+    if (args.record && !args.replay)
+        replay::record(args.record, seed, state.ticks);
+    if (args.audio && !audio::init_offline(state.ticks, args.audio))
+        return 1;
+
+    int frames = args.frames > 0 ? args.frames : args.replay ? -1 : 10000;
+    int frame;
+    int diverged = -1;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (frame = 0; frame != frames && !state.over; ++frame)
+    {
+        u32 dticks = STEP;
+        u32 expected = 0;
+        Input input;
+        if (args.replay)
+        {
+            if (!replay::play_frame(dticks, input, expected))
+                break;
+        }
+        else
+        {
+            input = input::synthesize(frame);
+        }
+
+        state.ticks += dticks;
+        state.dticks = dticks;
+
+        events::clear();
+
+        profile::begin(P_UPDATE);
+        game::update(state, state.ticks, args.debug, input);
+        events::dispatch(state);
+        profile::end(P_UPDATE);
+
+        if (args.audio)
+        {
+            profile::begin(P_AUDIO);
+            audio::update(state, state.ticks);
+            audio::render(state.ticks);
+            profile::end(P_AUDIO);
+        }
+        profile::end_frame();
+
+        u32 hash = game::hash(state);
+        if (args.replay && hash != expected && diverged < 0)
+            diverged = frame;
+        if (args.record && !args.replay)
+            replay::record_frame(dticks, input, hash);
+    }
+    Uint64 end = SDL_GetPerformanceCounter();
+    replay::close();
+
+    double seconds = (double)(end - start) / SDL_GetPerformanceFrequency();
+    cout << "Simulated " << frame << " ticks in " << seconds << "s: "
+         << frame / seconds << " ticks per second" << endl;
+    audio::finish_offline();
+
+    if (args.debug)
+    {
+        game::print_stats(state);
+        events::print_stats();
+        profile::dump(args.profile);
+    }
+
+    if (diverged >= 0)
+    {
+        cerr << "Replay diverged from the recording at frame " << diverged << endl;
+        return 2;
+    }
+    return 0;
+}
+
 int _setup()
 {
     // Fire up SDL
@@ -200,11 +363,29 @@ int _setup()
         fprintf(stderr, "Error: %s\n", glewGetErrorString(err));
         return 4;
     }
+
+    // Present on the display's refresh
+    vsync = SDL_GL_SetSwapInterval(1) == 0;
+    if (!vsync)
+        cerr << "Couldn't turn on vsync, sleeping between frames instead: " << SDL_GetError() << endl;
     return 0;
 }
 
 void _cleanup()
 {
+    replay::close();
+    if (args.debug)
+    {
+        game::print_stats(state);
+        events::print_stats();
+        audio::print_stats();
+        gfx::print_stats();
+        profile::dump(args.profile);
+    }
+
+    game::release(current);
+    game::release(previous);
+    game::release(state);
     input::cleanup();
     SDL_GL_DeleteContext(context);
     SDL_Quit();
@@ -212,15 +393,20 @@ void _cleanup()
 
 void _update()
 {
+    profile::begin(P_FRAME);
+
     // Timing
     u32 ticks = SDL_GetTicks();
-    state.dticks = ticks - state.ticks;
-    state.ticks = ticks;
-    u32 before = ticks;
-    u32 after;
+    Uint64 now = SDL_GetPerformanceCounter();
+    lag += (now - lastframe) * 1000.0 / SDL_GetPerformanceFrequency();
+    lag = min(lag, MAX_LAG);
+    lastframe = now;
 
     // Input
+    profile::begin(P_INPUT);
     Input input = input::handle_input();
+    merge_input(pending, input);
+    profile::end(P_INPUT);
     if (input.sys.quit) 
     {
         state.over = true;
@@ -232,27 +418,46 @@ void _update()
             bml::logger << "Remaining in windowed mode\n";
     }
 
-    // Zero out events. Sophisticated, I know.
-    memset(&state.events, 0, sizeof(state.events));
-    state.next_event = 0;
-
-    // Process gameplay
-    game::update(state, ticks, args.debug, input);
-    after = SDL_GetTicks();
-    /* cerr << "Gameplay took " << (after - before) << endl; */
+    // Process gameplay, as many steps as have come due
+    profile::begin(P_UPDATE);
+    while (lag >= STEP)
+    {
+        game::snapshot(previous, state);
+        state.ticks += STEP;
+        state.dticks = STEP;
+
+        // Last step's events have been handled
+        events::clear();
+        game::update(state, state.ticks, args.debug, pending);
+        events::dispatch(state);
+        if (args.record)
+            replay::record_frame(state.dticks, pending, game::hash(state));
+
+        consume_input(pending);
+        lag -= STEP;
+    }
+    profile::end(P_UPDATE);
 
-    // Render graphics
-    before = SDL_GetTicks();
-    gfx::render(state, ticks, args.debug, input);
-    after = SDL_GetTicks();
-    /* cerr << "Render took " << (after - before) << endl; */
+    // Render graphics, partway between the last two steps
+    profile::begin(P_RENDER);
+    game::snapshot(current, state);
+    game::interpolate(state, previous, lag / STEP);
+    gfx::render(state, state.ticks, args.debug, input);
+    game::restore(state, current);
+    profile::end(P_RENDER);
 
     // Update audio
+    profile::begin(P_AUDIO);
     audio::update(state, ticks);
+    profile::end(P_AUDIO);
 
     // Commit
+    profile::begin(P_SWAP);
     SDL_GL_SwapWindow(win);
+    profile::end(P_SWAP);
 
+    profile::end(P_FRAME);
+    profile::end_frame();
 }
 
 int scratch()
@@ -263,10 +468,15 @@ int scratch()
 extern "C"
 int main(int argc, char** argv)
 {
+    args.profile = "profile.csv";
     int code = parse_args(argc, argv, &args);
     if (code) return code;
 
-    srand(time(NULL));
+    seed = time(NULL);
+    srand(seed);
+
+    if (args.headless)
+        return headless();
 
     RETURN_IF_NONZERO(_setup());
 
@@ -4,10 +4,10 @@
 
 STRINGIFY(
 varying vec4 glPos;
-attribute vec4 inPos;
+attribute vec2 inPos;
 
 void main() {
-    gl_Position = glPos = inPos;
+    gl_Position = glPos = vec4(inPos, 0, 1);
 }
 
 )
@@ -0,0 +1,127 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include "SDL.h"
+#include "vec.h"
+
+using namespace std;
+
+// Frame phase timings. Each phase adds up its time over a frame, then
+// end_frame files the total away in a ring of recent frames, which is
+// what the percentiles are taken over.
+//
+// GL calls return before the GPU has done the work, so render mostly
+// measures submission; the wait for the GPU tends to show up in swap.
+namespace profile {
+
+const int WINDOW = 512; // frames, about 10s at 50fps
+
+const char* NAMES[P_LAST] = {
+    "input",
+    "update",
+    "collide",
+    "render",
+    "glow",
+    "glow_gpu",
+    "audio",
+    "swap",
+    "frame",
+};
+
+struct _Profiler {
+    Uint64 start[P_LAST]; // when the phase was entered, if it's running
+    Uint64 elapsed[P_LAST]; // this frame so far
+
+    float samples[P_LAST][WINDOW]; // microseconds, ring
+    int frames;
+
+    // Whole run
+    double total[P_LAST];
+    float worst[P_LAST];
+} profiler;
+
+float to_micros(Uint64 counts)
+{
+    static double scale = 1e6 / SDL_GetPerformanceFrequency();
+    return counts * scale;
+}
+
+void begin(int phase)
+{
+    profiler.start[phase] = SDL_GetPerformanceCounter();
+}
+
+void end(int phase)
+{
+    profiler.elapsed[phase] += SDL_GetPerformanceCounter() - profiler.start[phase];
+}
+
+void add(int phase, float micros)
+{
+    profiler.elapsed[phase] += micros * SDL_GetPerformanceFrequency() / 1e6;
+}
+
+void end_frame()
+{
+    int slot = profiler.frames % WINDOW;
+    for (int p = 0; p < P_LAST; ++p)
+    {
+        float us = to_micros(profiler.elapsed[p]);
+        profiler.samples[p][slot] = us;
+        profiler.total[p] += us;
+        profiler.worst[p] = max(profiler.worst[p], us);
+        profiler.elapsed[p] = 0;
+    }
+    ++profiler.frames;
+}
+
+const char* name(int phase)
+{
+    return NAMES[phase];
+}
+
+PhaseStats stats(int phase)
+{
+    PhaseStats ret = {0};
+    int n = min(profiler.frames, WINDOW);
+    if (n == 0) return ret;
+
+    float sorted[WINDOW];
+    memcpy(sorted, profiler.samples[phase], n * sizeof(float));
+    sort(sorted, sorted + n);
+
+    float sum = 0;
+    for (int i = 0; i < n; ++i)
+        sum += sorted[i];
+    ret.mean = sum / n;
+    ret.p50 = sorted[n * 50 / 100];
+    ret.p95 = sorted[n * 95 / 100];
+    ret.p99 = sorted[n * 99 / 100];
+    ret.max = sorted[n - 1];
+    return ret;
+}
+
+// One row per phase. Percentiles cover the last WINDOW frames,
+// mean and max the whole run.
+bool dump(const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file)
+    {
+        fprintf(stderr, "Couldn't open %s for the profile\n", filename);
+        return false;
+    }
+
+    fprintf(file, "phase,frames,p50_us,p95_us,p99_us,mean_us,max_us\n");
+    for (int p = 0; p < P_LAST; ++p)
+    {
+        PhaseStats s = stats(p);
+        float mean = profiler.frames ? profiler.total[p] / profiler.frames : 0;
+        fprintf(file, "%s,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n", NAMES[p], profiler.frames,
+                s.p50, s.p95, s.p99, mean, profiler.worst[p]);
+    }
+    fclose(file);
+    return true;
+}
+
+} // namespace profile
@@ -4,7 +4,7 @@
 STRINGIFY(
 
     varying vec4 glPos;
-    attribute vec4 inPos;
+    attribute vec2 inPos;
     uniform vec2 offset;
     uniform float rotation;
     uniform float ticks;
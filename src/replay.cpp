@@ -0,0 +1,150 @@
+#include <cstdio>
+#include <cstring>
+#include "vec.h"
+
+using namespace std;
+
+// Recorded sessions. A file is a header followed by one record per frame:
+//
+//   header: "VECR", u32 version, u32 seed, u32 ticks the game started at,
+//           the GameParams it ran with
+//   frame:  u32 dticks, 8 x f32 axes, u16 buttons, u32 hash of the state
+//           after the frame was simulated
+//
+// Everything is stored in native byte order.
+namespace replay {
+
+const char MAGIC[4] = { 'V', 'E', 'C', 'R' };
+const u32 VERSION = 3;
+
+// Button bits
+enum {
+    B_QUIT       = 1 << 0,
+    B_FULLSCREEN = 1 << 1,
+    B_GLOWTOGGLE = 1 << 2,
+    B_PAUSE      = 1 << 3,
+    B_SHOOT      = 1 << 4,
+    B_POOP       = 1 << 5,
+    B_AUXSHOOT   = 1 << 6,
+    B_AUXPOOP    = 1 << 7,
+    B_ATTRACT    = 1 << 8,
+    B_RESPAWN    = 1 << 9,
+};
+
+FILE* file = NULL;
+
+bool record(const char* filename, u32 seed, u32 ticks)
+{
+    file = fopen(filename, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "Couldn't open %s for recording\n", filename);
+        return false;
+    }
+    fwrite(MAGIC, sizeof(MAGIC), 1, file);
+    fwrite(&VERSION, sizeof(VERSION), 1, file);
+    fwrite(&seed, sizeof(seed), 1, file);
+    fwrite(&ticks, sizeof(ticks), 1, file);
+    fwrite(&game::params, sizeof(game::params), 1, file);
+    return true;
+}
+
+void record_frame(u32 dticks, const Input& input, u32 hash)
+{
+    if (!file) return;
+
+    float axes[8] = {
+        input.axes.x1, input.axes.x2, input.axes.x3, input.axes.x4,
+        input.axes.y1, input.axes.y2, input.axes.y3, input.axes.y4,
+    };
+    uint16_t buttons = 0;
+    if (input.sys.quit)       buttons |= B_QUIT;
+    if (input.sys.fullscreen) buttons |= B_FULLSCREEN;
+    if (input.sys.glowtoggle) buttons |= B_GLOWTOGGLE;
+    if (input.pause)          buttons |= B_PAUSE;
+    if (input.shoot)          buttons |= B_SHOOT;
+    if (input.poop)           buttons |= B_POOP;
+    if (input.auxshoot)       buttons |= B_AUXSHOOT;
+    if (input.auxpoop)        buttons |= B_AUXPOOP;
+    if (input.attract)        buttons |= B_ATTRACT;
+    if (input.respawn)        buttons |= B_RESPAWN;
+
+    fwrite(&dticks, sizeof(dticks), 1, file);
+    fwrite(axes, sizeof(axes), 1, file);
+    fwrite(&buttons, sizeof(buttons), 1, file);
+    fwrite(&hash, sizeof(hash), 1, file);
+}
+
+// Also puts back the params it was recorded with, so call it before game::init
+bool play(const char* filename, u32& seed, u32& ticks)
+{
+    file = fopen(filename, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "Couldn't open %s for replay\n", filename);
+        return false;
+    }
+
+    char magic[4];
+    u32 version;
+    GameParams params;
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, MAGIC, sizeof(MAGIC))
+     || fread(&version, sizeof(version), 1, file) != 1 || version != VERSION
+     || fread(&seed, sizeof(seed), 1, file) != 1
+     || fread(&ticks, sizeof(ticks), 1, file) != 1
+     || fread(&params, sizeof(params), 1, file) != 1)
+    {
+        fprintf(stderr, "%s isn't a replay this version can read\n", filename);
+        close();
+        return false;
+    }
+
+    if (memcmp(&params, &game::params, sizeof(params)))
+        fprintf(stderr, "Replaying with the params %s was recorded with, not the current ones\n", filename);
+    game::params = params;
+    return true;
+}
+
+// Returns false at the end of the recording
+bool play_frame(u32& dticks, Input& input, u32& hash)
+{
+    if (!file) return false;
+
+    float axes[8];
+    uint16_t buttons;
+    if (fread(&dticks, sizeof(dticks), 1, file) != 1
+     || fread(axes, sizeof(axes), 1, file) != 1
+     || fread(&buttons, sizeof(buttons), 1, file) != 1
+     || fread(&hash, sizeof(hash), 1, file) != 1)
+        return false;
+
+    memset(&input, 0, sizeof(input));
+    input.axes.x1 = axes[0];
+    input.axes.x2 = axes[1];
+    input.axes.x3 = axes[2];
+    input.axes.x4 = axes[3];
+    input.axes.y1 = axes[4];
+    input.axes.y2 = axes[5];
+    input.axes.y3 = axes[6];
+    input.axes.y4 = axes[7];
+    input.sys.quit       = buttons & B_QUIT;
+    input.sys.fullscreen = buttons & B_FULLSCREEN;
+    input.sys.glowtoggle = buttons & B_GLOWTOGGLE;
+    input.pause          = buttons & B_PAUSE;
+    input.shoot          = buttons & B_SHOOT;
+    input.poop           = buttons & B_POOP;
+    input.auxshoot       = buttons & B_AUXSHOOT;
+    input.auxpoop        = buttons & B_AUXPOOP;
+    input.attract        = buttons & B_ATTRACT;
+    input.respawn        = buttons & B_RESPAWN;
+    return true;
+}
+
+void close()
+{
+    if (file)
+        fclose(file);
+    file = NULL;
+}
+
+} // namespace replay
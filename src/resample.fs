@@ -0,0 +1,23 @@
+/* This file is (ab)used by the C preprocessor
+   to embed shaders in gfx.cpp at compile time. */
+#include "common.glsl"
+
+STRINGIFY(
+varying vec4 glPos;
+uniform sampler2D texSource;
+uniform vec2 textureSize;
+uniform float radius; /* source pixels out from the middle */
+
+/* Average of four linearly filtered fetches around the pixel, for
+   shrinking or growing a texture without it getting blocky */
+void main() {
+  vec2 pos = (glPos.xy + vec2(1,1)) / 2.0;
+  vec2 d = radius / textureSize;
+  vec4 final = texture2D(texSource, pos + vec2(-d.x, -d.y));
+  final += texture2D(texSource, pos + vec2(d.x, -d.y));
+  final += texture2D(texSource, pos + vec2(-d.x, d.y));
+  final += texture2D(texSource, pos + d);
+  gl_FragColor = final * 0.25;
+}
+)
+#undef STRINGIFY
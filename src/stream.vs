@@ -0,0 +1,17 @@
+/* This file is (ab)used by the C preprocessor
+   to embed shaders in gfx.cpp at compile time. */
+#include "common.glsl"
+
+STRINGIFY(
+    varying vec4 glPos;
+    varying float glHue;
+    attribute vec2 inPos;
+    attribute float inHue;
+
+void main() {
+    gl_Position = glPos = vec4(inPos, 0, 1);
+    glHue = inHue;
+}
+
+)
+#undef STRINGIFY
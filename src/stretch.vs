@@ -3,7 +3,7 @@
 #include "common.glsl"
 
 STRINGIFY(
-    attribute vec4 inPos;
+    attribute vec2 inPos;
     uniform float scale = 1;
     uniform float percent;
     varying vec4 glPos;
@@ -13,6 +13,6 @@ void main() {
     float x = (inPos.x-1) * 0.05 + 1;
     float y = inPos.y * 0.5;
     gl_Position = glPos = vec4(x, y, 0, 1);
-    glInPos = inPos;
+    glInPos = vec4(inPos, 0, 1);
 }
 )
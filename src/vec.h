@@ -15,9 +15,31 @@ enum {
     E_LAST,
 };
 
-const int MAX_ENEMIES = 15;
-const int MAX_ENTITIES = 500;
-const int MAX_EVENTS = 20;
+// What to do when there's no room for a new ent
+enum {
+    OVERFLOW_EVICT, // replace the oldest ent of the same type, or failing that the oldest non-enemy
+    OVERFLOW_DROP, // don't add it
+};
+
+// Sizes and tuning, fixed for a run. Defaults are in game.cpp; main can
+// override them from a file or the command line before game::init.
+typedef struct _GameParams {
+    int maxentities; // size of the entity pool
+    int maxenemies; // biggest wave
+    float movespeed;
+    float playersize;
+    float squarespeed;
+    float mousemovespeed;
+    float rotspeed;
+    float drag;
+    float bulletdrag;
+    float bulletspeed;
+    float enemyspeed;
+    float hitbox;
+    float squaregrowth;
+    float squaregravity;
+    float squaredecay;
+} GameParams;
 
 typedef struct _Entity {
     EType type;
@@ -28,6 +50,48 @@ typedef struct _Entity {
     float hue;
 } Entity;
 
+// Enemies, bullets, and stuff, stored as parallel arrays indexed by slot.
+// The arrays are carved out of one block of storage, sized at game::init,
+// so copy states with game::copy rather than by value.
+typedef struct _Entities {
+    int capacity; // slots
+    char* storage;
+
+    EType* type;
+    float* life;
+    float* x;
+    float* y;
+    float* vx;
+    float* vy;
+    float* rotation;
+    float* hue;
+
+    // Packed slots of live ents, per type
+    int* live[E_LAST];
+    int count[E_LAST];
+
+    int* index; // each slot's place in its live list, -1 if dead
+    int total; // live ents of all types
+
+    // Slot allocator
+    int* free; // stack of unused slots
+    int nfree;
+    int overflow; // OVERFLOW_* policy when there are no free slots
+
+    // Live slots in order of creation, per type, for eviction
+    u32* born; // creation serial of each slot
+    u32 serial;
+    int* older;
+    int* newer;
+    int oldest[E_LAST];
+    int newest[E_LAST];
+
+    // Pool pressure, for sizing the pool
+    int evicted[E_LAST];
+    int dropped[E_LAST];
+    int peak;
+} Entities;
+
 typedef struct _Player : public Entity {
     float size;
     float phase; // norm
@@ -47,20 +111,19 @@ typedef struct _Event {
     } type;
 
     EType entity;
+    bml::Vec pos;
+    float hue;
+    float damage; // for T_ENT_HIT
 } Event;
 
 typedef struct _GameState {
 
     u32 ticks; // Millis since start
     u32 dticks; // Millis since last frame
+    u32 rng; // Gameplay's own random state, so runs can be replayed
 
     // Enemies, bullets, and stuff
-    Entity entities[MAX_ENTITIES];
-    int next;
-
-    // Events that happened this frame
-    Event events[MAX_EVENTS];
-    int next_event;
+    Entities entities;
 
     // Player
     Player player;
@@ -74,6 +137,29 @@ typedef struct _GameState {
     bool over; // game over?
 } GameState;
 
+// The little collide needs from before this frame's movement
+typedef struct _Previous {
+    bml::Vec squarepos;
+} Previous;
+
+// What drawing between steps needs of a step: where things were. Only
+// live slots are filled in, so taking one costs what's alive, not the pool.
+typedef struct _Snapshot {
+    int capacity;
+    char* storage;
+    EType* type;
+    u32* born;
+    float* x;
+    float* y;
+    float* rotation;
+    float* life;
+
+    u32 ticks;
+    Player player;
+    bml::Vec squarepos;
+    float squaresize;
+} Snapshot;
+
 typedef struct _Input {
 
     // System-y actions
@@ -101,33 +187,139 @@ typedef struct _Input {
 
 } Input;
 
-static float beats_per_minute(const GameState& state)
+static inline float beats_per_minute(const GameState& state)
 {
     return 120 - 2 * state.player.killcount * bml::minimum(state.player.size, 1);
 }
 
 namespace gfx
 {
-void init();
+void init(bool debug);
 void render(GameState& state, u32 ticks, bool debug, const Input& input);
-void set_viewport(int x, int y);
+void set_viewport(int x, int y); // the window's size
+void print_stats();
 }
 
 namespace game
 {
-void init(GameState& state);
+extern GameParams params;
+bool set_param(const char* name, const char* value);
+bool load_params(const char* filename);
+
+void init(GameState& state, u32 seed); // (re)allocates the pool to params.maxentities
+void copy(GameState& to, const GameState& from);
+void release(GameState& state);
 void update(GameState& state, u32 ticks, bool debug, const Input& input);
+// For drawing between steps: interpolate moves state t of the way back
+// from a snapshot of it, restore puts it back the way it was
+void snapshot(Snapshot& out, const GameState& state);
+void interpolate(GameState& state, const Snapshot& from, float t);
+void restore(GameState& state, const Snapshot& from);
+void release(Snapshot& snapshot);
+u32 hash(const GameState& state);
+void print_stats(const GameState& state);
+
+// Internals, exposed for the benchmarks
+int add_entity(GameState& state, Entity& e);
+void spawn_enemies(GameState& state);
+void collide(GameState& state, const Previous& previous);
+void collide_entities(GameState& state);
+void collide_entities_reference(GameState& state);
+float check_segment_intersection(bml::Vec p, bml::Vec q, bml::Vec r, bml::Vec s);
 }
 
 namespace audio
 {
-void init(u32 ticks);
+void init(u32 ticks, bool debug);
 void update(const GameState& state, u32 ticks);
+void mute();
+void print_stats();
+
+// Render to a WAV file instead of the sound card, as fast as we can
+bool init_offline(u32 ticks, const char* filename);
+void render(u32 ticks);
+void finish_offline();
+}
+
+// What happened this frame, for audio and gfx. Kept outside the state,
+// which is what gets hashed and replayed.
+typedef void (*Subscriber)(const GameState& state, const Event& event);
+
+typedef struct _EventStats {
+    u32 emitted; // over the run
+    int peak; // in one frame
+    int capacity; // events the stream has room for without allocating
+    u32 grown; // times it had to allocate
+    u32 dropped; // couldn't allocate
+} EventStats;
+
+namespace events
+{
+void emit(const Event& event);
+int count();
+const Event& get(int i);
+void truncate(int n);
+void clear();
+bool subscribe(u32 types, Subscriber fn); // types is a mask of 1 << Event::T_*
+void dispatch(const GameState& state);
+EventStats stats();
+void print_stats();
+}
+
+namespace replay
+{
+bool record(const char* filename, u32 seed, u32 ticks);
+void record_frame(u32 dticks, const Input& input, u32 hash);
+bool play(const char* filename, u32& seed, u32& ticks);
+bool play_frame(u32& dticks, Input& input, u32& hash);
+void close();
 }
 
 namespace input
 {
 void init();
 Input handle_input();
+Input synthesize(u32 frame);
 void cleanup();
 }
+
+// Parts of a frame the profiler times
+enum {
+    P_INPUT,
+    P_UPDATE,
+    P_COLLIDE, // part of P_UPDATE
+    P_RENDER,
+    P_GLOW, // part of P_RENDER
+    P_GLOW_GPU, // what P_GLOW costs the GPU, a few frames late
+    P_AUDIO,
+    P_SWAP,
+    P_FRAME, // all of the above and then some
+    P_LAST,
+};
+
+// Microseconds spent in a phase per frame, over the last few seconds
+typedef struct _PhaseStats {
+    float mean;
+    float p50;
+    float p95;
+    float p99;
+    float max;
+} PhaseStats;
+
+namespace profile
+{
+void begin(int phase);
+void end(int phase);
+void add(int phase, float micros); // time measured some other way
+void end_frame();
+const char* name(int phase);
+PhaseStats stats(int phase);
+bool dump(const char* filename);
+}
+
+// Times the enclosing block
+typedef struct _Profile {
+    int phase;
+    _Profile(int phase) : phase(phase) { profile::begin(phase); }
+    ~_Profile() { profile::end(phase); }
+} Profile;
@@ -3,7 +3,7 @@
 #include "common.glsl"
 
 STRINGIFY(
-    attribute vec4 inPos;
+    attribute vec2 inPos;
     uniform vec2 offset;
     uniform float rotation;
     uniform float ticks;
@@ -0,0 +1,28 @@
+/* This file is (ab)used by the C preprocessor
+   to embed shaders in gfx.cpp at compile time. */
+#include "common.glsl"
+
+STRINGIFY(
+    attribute vec2 inPos;
+    attribute vec2 inOffset;
+    attribute float inRotation;
+    attribute float inScale;
+    attribute float inHue;
+    uniform float ticks;
+    varying vec4 glPos;
+    varying float glHue;
+    const float frequency = 2;
+
+void main() {
+    vec2 rotated;
+    rotated.x = inPos.x * cos(inRotation) - inPos.y * sin(inRotation);
+    rotated.y = inPos.x * sin(inRotation) + inPos.y * cos(inRotation);
+    float phase = ticks * frequency / 1000.0;
+    vec2 pos = rotated * (1 + 0.02 * sin(phase * mPI));
+    pos *= inScale;
+    pos.x += 0.2 * (inPos.x - inPos.y) * cos(phase * mPI);
+    pos.y += 0.2 * (inPos.x - inPos.y) * sin(phase * mPI);
+    gl_Position = glPos = vec4(inOffset + pos, 0, 1);
+    glHue = inHue;
+}
+)